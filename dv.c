@@ -9,39 +9,68 @@
 
 #include "routing-simulator.h"
 
-// Message format to send between nodes.
-typedef struct data_t {
-    cost_t distance_vector[MAX_NODES]; // The distance vector from the sender
-} data_t;
+// Message format to send between nodes: a header, then either the whole
+// distance vector, one cost per destination, or only the entries that changed
+// since the sender's previous message to the receiver. Entries name their
+// destination in 16 bits, or in a node_t when there are more node IDs than
+// that, as both ends can tell from get_num_nodes().
+typedef struct header_t {
+    uint32_t full; // Whether the whole distance vector follows
+} header_t;
+
+typedef struct entry_t {
+    uint16_t destination;
+    cost_t cost;
+} entry_t;
+
+typedef struct wide_entry_t {
+    node_t destination;
+    cost_t cost;
+} wide_entry_t;
+
+static int uses_wide_entries() {
+    return get_num_nodes() > UINT16_MAX + 1;
+}
 
 // State format
-typedef struct state_t {
-    cost_t distance_vector[MAX_NODES];          // Current node's distance vector
-    cost_t neighbor_costs[MAX_NODES][MAX_NODES]; // Neighbors' distance vectors to destinations
+typedef struct dv_state_t {
+    cost_t *distance_vector; // Current node's distance vector
+    cost_t *link_costs;      // Last known cost of the link to each node
+    cost_t **neighbor_costs; // Neighbors' distance vectors to destinations, by slot
+    cost_t **advertised;     // Distance vector last sent to each neighbor, by slot
+    int *slots;              // Slot of each neighbor's rows, or -1
+    int num_slots;
+    node_t *changed;         // Scratch list of destinations to advertise
+    int *dirty;              // Whether each destination changed since the last broadcast
+    node_t *dirty_nodes;     // Destinations that changed, in the order they did
+    int num_dirty;
 } state_t;
 
 // Print distance vector (for debugging)
-void print_distance_vector(state_t *state) {
-    printf("Node %d: Distance vector:\n", get_current_node());
+static void print_distance_vector(state_t *state) {
+    LOG(LOG_DEBUG, "Node %d: Distance vector:\n", get_current_node());
     for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
         if (n == get_current_node()) continue;
-        printf("  To %d: %d\n", n, state->distance_vector[n]);
+        LOG(LOG_DEBUG, "  To %d: %d\n", n, state->distance_vector[n]);
     }
 }
 
 // Initialize the state
-state_t *init_state() {
-    printf("Initializing node %d\n", get_current_node());
+static void *init_state() {
+    LOG(LOG_INFO, "Initializing node %d\n", get_current_node());
     state_t *state = (state_t *)calloc(1, sizeof(state_t));
+    int num_nodes = get_num_nodes();
+    state->distance_vector = (cost_t *)calloc(num_nodes, sizeof(cost_t));
+    state->changed = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->dirty = (int *)calloc(num_nodes, sizeof(int));
+    state->dirty_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->link_costs = (cost_t *)calloc(num_nodes, sizeof(cost_t));
+    state->slots = (int *)calloc(num_nodes, sizeof(int));
 
     for (node_t i = get_first_node(); i <= get_last_node(); i = get_next_node(i)) {
         state->distance_vector[i] = COST_INFINITY;
-        for (node_t j = get_first_node(); j <= get_last_node(); j = get_next_node(j)) {
-            state->neighbor_costs[i][j] = COST_INFINITY;
-            if (i == j) {
-                state->neighbor_costs[i][j] = 0;
-            }
-        }
+        state->link_costs[i] = COST_INFINITY;
+        state->slots[i] = -1;
     }
 
     node_t current_node = get_current_node();
@@ -51,85 +80,215 @@ state_t *init_state() {
     return state;
 }
 
-// Recalculate the distance vector using Bellman-Ford
-int recalculate_distance_vector(state_t *state) {
-    int updated = 0;
-    node_t current_node = get_current_node();
+// Free the state
+static void free_state(void *node_state) {
+    state_t *state = (state_t *)node_state;
+    for (int slot = 0; slot < state->num_slots; slot++) {
+        free(state->neighbor_costs[slot]);
+        free(state->advertised[slot]);
+    }
+    free(state->neighbor_costs);
+    free(state->advertised);
+    free(state->slots);
+    free(state->link_costs);
+    free(state->dirty_nodes);
+    free(state->dirty);
+    free(state->changed);
+    free(state->distance_vector);
+    free(state);
+}
 
-    for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-        if (dest == current_node) continue;
+// Allocate the rows kept for a neighbor, the first time it is one. Its
+// distance vector starts unknown, and the one last sent to it as what it
+// assumes before hearing from us.
+static int add_slot(state_t *state, node_t neighbor) {
+    int num_nodes = get_num_nodes();
+    int slot = state->slots[neighbor] = state->num_slots++;
+    state->neighbor_costs = (cost_t **)realloc(state->neighbor_costs, state->num_slots * sizeof(cost_t *));
+    state->advertised = (cost_t **)realloc(state->advertised, state->num_slots * sizeof(cost_t *));
+    state->neighbor_costs[slot] = (cost_t *)malloc(num_nodes * sizeof(cost_t));
+    memset(state->neighbor_costs[slot], COST_INFINITY, num_nodes * sizeof(cost_t));
+    state->neighbor_costs[slot][neighbor] = 0;
+    state->advertised[slot] = (cost_t *)malloc(num_nodes * sizeof(cost_t));
+    memset(state->advertised[slot], COST_INFINITY, num_nodes * sizeof(cost_t));
+    state->advertised[slot][get_current_node()] = 0;
+    return slot;
+}
 
-        printf("Lets calculate the best distance to %d from node %d\n", dest, current_node);
+// Slot of the rows kept for a neighbor. Kept apart from add_slot() so that
+// lookups in the inner loops stay small enough to inline.
+static int neighbor_slot(state_t *state, node_t neighbor) {
+    return state->slots[neighbor] >= 0 ? state->slots[neighbor] : add_slot(state, neighbor);
+}
+
+// Distance vector last received from a neighbor.
+static cost_t *neighbor_costs_of(state_t *state, node_t neighbor) {
+    int slot = neighbor_slot(state, neighbor);
+    return state->neighbor_costs[slot];
+}
 
-        cost_t best_cost = get_link_cost(dest);
-        printf("  Initial best cost: %d\n", best_cost);
-        node_t best_next_hop = -1;
+// Distance vector last sent to a neighbor.
+static cost_t *advertised_to(state_t *state, node_t neighbor) {
+    int slot = neighbor_slot(state, neighbor);
+    return state->advertised[slot];
+}
 
-        for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-            if (n == current_node) continue;
+// Mark a destination whose distance changed, to advertise at the next
+// broadcast.
+static void mark_dirty(state_t *state, node_t dest) {
+    if (!state->dirty[dest]) {
+        state->dirty[dest] = 1;
+        state->dirty_nodes[state->num_dirty++] = dest;
+    }
+}
 
-            printf("  Distance to neighbor%d is %d, cost from neighbor%d to dest%d is %d\n", n, get_link_cost(n), n, dest, state->neighbor_costs[n][dest]);
-            cost_t cost_via_n = COST_ADD(get_link_cost(n), state->neighbor_costs[n][dest]);
-            if (cost_via_n <= best_cost) {
-                best_cost = cost_via_n;
-                best_next_hop = n;
+// Send each neighbor the entries of the distance vector that changed since the
+// last message to it. The whole vector is sent to full_neighbor, if any. Every
+// handler that changes distances broadcasts them, so the vectors last sent to
+// the other neighbors can only differ at the dirty destinations. These are
+// marked in the order of the entries received, which keeps them sorted.
+static void broadcast_message(state_t *state, node_t full_neighbor) {
+    int num_nodes = get_num_nodes();
+    int wide = uses_wide_entries();
+    size_t entry_size = wide ? sizeof(wide_entry_t) : sizeof(entry_t);
+    for (node_t n = get_first_neighbor(); n >= 0; n = get_next_neighbor(n)) {
+        cost_t *advertised = advertised_to(state, n);
+        int num_entries = 0;
+        int num_dests = n == full_neighbor ? num_nodes : state->num_dirty;
+        for (int i = 0; i < num_dests; i++) {
+            node_t dest = n == full_neighbor ? i : state->dirty_nodes[i];
+            cost_t cost = state->distance_vector[dest];
+            if (n == full_neighbor || cost != advertised[dest]) {
+                advertised[dest] = cost;
+                state->changed[num_entries++] = dest;
             }
         }
+        if (num_entries == 0) continue;
 
-        if (best_cost != state->distance_vector[dest]) {
-            printf("  Best cost to %d is %d via %d\n", dest, best_cost, best_next_hop);
-            state->distance_vector[dest] = best_cost;
-            set_route(dest, best_next_hop, best_cost);
-            updated = 1;
+        if (n == full_neighbor) {
+            header_t *header = (header_t *)reserve_message(n, sizeof(header_t) + num_nodes * sizeof(cost_t));
+            header->full = 1;
+            memcpy(header + 1, advertised, num_nodes * sizeof(cost_t));
+        } else {
+            header_t *header = (header_t *)reserve_message(n, sizeof(header_t) + num_entries * entry_size);
+            header->full = 0;
+            entry_t *entries = (entry_t *)(header + 1);
+            wide_entry_t *wide_entries = (wide_entry_t *)(header + 1);
+            for (int e = 0; e < num_entries; e++) {
+                node_t dest = state->changed[e];
+                if (wide) {
+                    wide_entries[e].destination = dest;
+                    wide_entries[e].cost = advertised[dest];
+                } else {
+                    entries[e].destination = dest;
+                    entries[e].cost = advertised[dest];
+                }
+            }
         }
+        LOG(LOG_INFO, "BM: Node %d: Sending message to neighbor %d\n", get_current_node(), n);
+        commit_message();
     }
 
-    return updated;
+    for (int i = 0; i < state->num_dirty; i++) {
+        state->dirty[state->dirty_nodes[i]] = 0;
+    }
+    state->num_dirty = 0;
 }
 
-// Notify a node that a neighboring link has changed cost
-void notify_link_change(node_t neighbor, cost_t new_cost) {
-    state_t *state = get_state();
-    printf("LC: Node %d: Link to neighbor %d changed to cost %d\n", get_current_node(), neighbor, new_cost);
+// Recalculate the distance to a destination using Bellman-Ford
+static int recalculate_destination(state_t *state, node_t dest) {
+    node_t current_node = get_current_node();
+    if (dest == current_node) return 0;
 
-    state->neighbor_costs[get_current_node()][neighbor] = new_cost;
+    LOG(LOG_TRACE, "Lets calculate the best distance to %d from node %d\n", dest, current_node);
 
-    if (recalculate_distance_vector(state)) {
-        printf("LC: Node %d: Distance vector updated after link cost change.\n", get_current_node());
-        print_distance_vector(state);
+    cost_t best_cost = get_link_cost(dest);
+    LOG(LOG_TRACE, "  Initial best cost: %d\n", best_cost);
+    node_t best_next_hop = -1;
 
-        data_t outgoing_data;
-        memcpy(outgoing_data.distance_vector, state->distance_vector, sizeof(outgoing_data.distance_vector));
-
-        for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-            if (get_link_cost(n) < COST_INFINITY && n != get_current_node()) {
-                send_message(n, &outgoing_data, sizeof(outgoing_data));
-            }
+    for (neighbor_link_t link = get_first_neighbor_link(); link.neighbor >= 0; link = get_next_neighbor_link(link)) {
+        node_t n = link.neighbor;
+        cost_t *neighbor_costs = neighbor_costs_of(state, n);
+        LOG(LOG_TRACE, "  Distance to neighbor%d is %d, cost from neighbor%d to dest%d is %d\n", n, link.cost, n, dest, neighbor_costs[dest]);
+        cost_t cost_via_n = COST_ADD(link.cost, neighbor_costs[dest]);
+        if (cost_via_n <= best_cost) {
+            best_cost = cost_via_n;
+            best_next_hop = n;
         }
     }
+
+    if (best_cost == state->distance_vector[dest]) {
+        return 0;
+    }
+
+    LOG(LOG_DEBUG, "  Best cost to %d is %d via %d\n", dest, best_cost, best_next_hop);
+    state->distance_vector[dest] = best_cost;
+    mark_dirty(state, dest);
+    set_route(dest, best_next_hop, best_cost);
+    return 1;
 }
 
-// Receive a message sent by a neighboring node
-void notify_receive_message(node_t sender, void *message, size_t length) {
-    printf("RM: Node %d: Received message from node %d\n", get_current_node(), sender);
-    state_t *state = get_state();
-    data_t *received_data = (data_t *)message;
+// Notify a node that a neighboring link has changed cost
+static void notify_link_change(node_t neighbor, cost_t new_cost) {
+    state_t *state = (state_t *)get_state();
+    LOG(LOG_INFO, "LC: Node %d: Link to neighbor %d changed to cost %d\n", get_current_node(), neighbor, new_cost);
+
+    // A neighbor that just came up needs the whole distance vector.
+    int link_up = state->link_costs[neighbor] == COST_INFINITY && new_cost < COST_INFINITY;
+    state->link_costs[neighbor] = new_cost;
 
+    // Only destinations reachable via the neighbor (or the neighbor itself)
+    // can change.
+    int updated = 0;
+    cost_t *neighbor_costs = neighbor_costs_of(state, neighbor);
     for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-        state->neighbor_costs[sender][dest] = received_data->distance_vector[dest];
+        if (dest == neighbor || neighbor_costs[dest] < COST_INFINITY) {
+            updated |= recalculate_destination(state, dest);
+        }
     }
 
-    if (recalculate_distance_vector(state)) {
-        printf("RM: Node %d: Distance vector updated after receiving message.\n", get_current_node());
+    if (updated) {
+        LOG(LOG_INFO, "LC: Node %d: Distance vector updated after link cost change.\n", get_current_node());
         print_distance_vector(state);
+    }
+    if (updated || link_up) {
+        broadcast_message(state, link_up ? neighbor : -1);
+    }
+}
 
-        data_t outgoing_data;
-        memcpy(outgoing_data.distance_vector, state->distance_vector, sizeof(outgoing_data.distance_vector));
+// Receive a message sent by a neighboring node
+static void notify_receive_message(node_t sender, void *message, size_t length) {
+    LOG(LOG_INFO, "RM: Node %d: Received message from node %d\n", get_current_node(), sender);
+    state_t *state = (state_t *)get_state();
+    header_t *header = (header_t *)message;
+    cost_t *costs = (cost_t *)(header + 1);
+    entry_t *entries = (entry_t *)(header + 1);
+    wide_entry_t *wide_entries = (wide_entry_t *)(header + 1);
+    int wide = uses_wide_entries();
+    size_t entry_size = wide ? sizeof(wide_entry_t) : sizeof(entry_t);
+    int num_entries = header->full ? get_num_nodes() : (length - sizeof(header_t)) / entry_size;
 
-        for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-            if (get_link_cost(n) < COST_INFINITY && n != get_current_node()) {
-                send_message(n, &outgoing_data, sizeof(outgoing_data));
-            }
+    // Only destinations whose cost via the sender changed can change.
+    int updated = 0;
+    cost_t *neighbor_costs = neighbor_costs_of(state, sender);
+    for (int e = 0; e < num_entries; e++) {
+        node_t dest = header->full ? e : wide ? wide_entries[e].destination : entries[e].destination;
+        cost_t cost = header->full ? costs[e] : wide ? wide_entries[e].cost : entries[e].cost;
+        if (neighbor_costs[dest] != cost) {
+            neighbor_costs[dest] = cost;
+            updated |= recalculate_destination(state, dest);
         }
     }
+
+    if (updated) {
+        LOG(LOG_INFO, "RM: Node %d: Distance vector updated after receiving message.\n", get_current_node());
+        print_distance_vector(state);
+
+        broadcast_message(state, -1);
+    }
 }
+
+// Notify a node that a timer it set has expired. No timers are set.
+static void notify_timer() {}
+
+REGISTER_PROTOCOL("dv")
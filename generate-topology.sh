@@ -0,0 +1,34 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# Usage: generate-topology.sh <nodes> <links> <changes> [seed]
+# Print a random connected topology of nodes, with as many links in total as
+# links (at least nodes - 1), followed by churn: changes link cost changes, one
+# every 10 epochs, each taking a random link down or giving it a new cost.
+NODES="${1}"
+LINKS="${2}"
+CHANGES="${3}"
+SEED="${4:-1}"
+
+awk -v nodes="$NODES" -v links="$LINKS" -v changes="$CHANGES" -v seed="$SEED" '
+  function cost() { return 1 + int(rand() * 20) }
+  function add(a, b) {
+    if (a > b) { t = a; a = b; b = t }
+    if (a == b || (a, b) in linked) return 0
+    linked[a, b] = 1
+    first[count] = a; second[count] = b; count++
+    print 0, a, b, cost()
+    return 1
+  }
+  BEGIN {
+    srand(seed)
+    count = 0
+    # A random tree keeps the network connected to begin with.
+    for (n = 1; n < nodes; n++) add(int(rand() * n), n)
+    while (count < links) add(int(rand() * nodes), int(rand() * nodes))
+    for (c = 1; c <= changes; c++) {
+      l = int(rand() * count)
+      print c * 10, first[l], second[l], rand() < 0.5 ? 255 : cost()
+    }
+  }'
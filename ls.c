@@ -3,6 +3,7 @@
 \******************************************************************************/
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -10,167 +11,663 @@
 #include "routing-simulator.h"
 
 typedef struct link_state_t {
-  cost_t link_cost[MAX_NODES];
+  cost_t *link_cost;
   int version;
+  // Nodes with a finite link cost from this node, rebuilt from link_cost, with
+  // room for max_neighbors of them.
+  node_t *neighbors;
+  int num_neighbors;
+  int max_neighbors;
+  // Nodes with a finite link cost to this node, in no particular order, with
+  // room for max_in_neighbors of them.
+  node_t *in_neighbors;
+  int num_in_neighbors;
+  int max_in_neighbors;
 } link_state_t;
 
-// Message format to send between nodes.
-typedef struct data_t {
-  link_state_t ls[MAX_NODES];
-} data_t;
+// Message format to send between nodes: a sequence of link state
+// advertisements, each the version and the links of their origin node.
+typedef struct lsa_t {
+  node_t origin;
+  int version;
+  int num_links;
+} lsa_t;
+
+typedef struct lsa_link_t {
+  node_t neighbor;
+  cost_t cost;
+} lsa_link_t;
+
+static size_t lsa_size(int num_links) {
+    return sizeof(lsa_t) + num_links * sizeof(lsa_link_t);
+}
+
+static lsa_link_t *lsa_links(lsa_t *lsa) {
+    return (lsa_link_t *)(lsa + 1);
+}
+
+static lsa_t *next_lsa(lsa_t *lsa) {
+    return (lsa_t *)((char *)lsa + lsa_size(lsa->num_links));
+}
 
 // State format.
-typedef struct state_t {
-  link_state_t link_states[MAX_NODES];
+typedef struct ls_state_t {
+  link_state_t *link_states;
+  // Shortest path tree, kept between runs and repaired incrementally.
+  cost_t *dist;
+  node_t *pred;
+  node_t *next_hop;
+  node_t *first_child;
+  node_t *next_sibling;
+  node_t *prev_sibling;
+  // Nodes detached from the tree since the last run.
+  int *invalid;
+  node_t *invalid_nodes;
+  int num_invalid;
+  // Nodes whose link costs changed since the last run.
+  int *changed;
+  node_t *changed_nodes;
+  int num_changed;
+  // Destinations whose route may have changed during the run.
+  int *touched;
+  node_t *touched_nodes;
+  int num_touched;
+  // Routes last given to set_route.
+  node_t *route_next_hop;
+  cost_t *route_cost;
+  // Advertisements to flood when the timer expires, and the neighbor each
+  // came from, or -1.
+  int *flooded;
+  node_t *flood_nodes;
+  int num_flood;
+  node_t *flood_from;
+  int timer_set;
+  // Epochs to hold shortest path first runs and flooding back for, so that a
+  // burst of advertisements is handled at once. 0 waits for the end of the
+  // epoch. Set with the spf-delay protocol option.
+  event_time_t spf_delay;
+  // Scratch space for the advertisements to send to one neighbor.
+  node_t *database_nodes;
+  // Scratch space for reading advertisements, COST_INFINITY between uses.
+  cost_t *lsa_costs;
+  // Priority queue of nodes whose distance is being repaired.
+  int *queued;
+  // Whether to pick the closest node with the original linear scan, for
+  // comparison, as set with the spf-linear-scan protocol option.
+  int linear_scan;
+  // Otherwise Dial's buckets, one bitset over nodes per distance below
+  // COST_INFINITY, with a cursor at the lowest bucket and word that may be
+  // non-empty.
+  uint64_t *buckets;
+  int bucket_words;
+  cost_t bucket;
+  int word;
 } state_t;
 
+// Make room for a number of neighbors in the neighbor list of a node.
+static void reserve_neighbors(link_state_t *link_state, int num_neighbors) {
+    if (num_neighbors > link_state->max_neighbors) {
+        link_state->max_neighbors = num_neighbors;
+        link_state->neighbors = (node_t *)realloc(link_state->neighbors, num_neighbors * sizeof(node_t));
+    }
+}
+
+// Rebuild the neighbor list of a node after its link costs changed.
+static void update_neighbors(link_state_t *link_state, node_t origin) {
+    int num_neighbors = 0;
+    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
+        num_neighbors += n != origin && link_state->link_cost[n] < COST_INFINITY;
+    }
+    reserve_neighbors(link_state, num_neighbors);
+    link_state->num_neighbors = 0;
+    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
+        if (n != origin && link_state->link_cost[n] < COST_INFINITY) {
+            link_state->neighbors[link_state->num_neighbors++] = n;
+        }
+    }
+}
+
+// Add a node to those with a finite link cost to a node.
+static void add_in_neighbor(link_state_t *link_state, node_t origin) {
+    if (link_state->num_in_neighbors == link_state->max_in_neighbors) {
+        link_state->max_in_neighbors = link_state->max_in_neighbors ? 2 * link_state->max_in_neighbors : 4;
+        link_state->in_neighbors = (node_t *)realloc(link_state->in_neighbors, link_state->max_in_neighbors * sizeof(node_t));
+    }
+    link_state->in_neighbors[link_state->num_in_neighbors++] = origin;
+}
+
+// Remove a node from those with a finite link cost to a node.
+static void remove_in_neighbor(link_state_t *link_state, node_t origin) {
+    for (int i = 0; i < link_state->num_in_neighbors; i++) {
+        if (link_state->in_neighbors[i] == origin) {
+            link_state->in_neighbors[i] = link_state->in_neighbors[--link_state->num_in_neighbors];
+            return;
+        }
+    }
+}
+
 // Handler for the node to allocate and initialize its state.
-state_t *init_state() {
+static void *init_state() {
     state_t *state = (state_t *)calloc(1, sizeof(state_t));
+    int num_nodes = get_num_nodes();
+    state->link_states = (link_state_t *)calloc(num_nodes, sizeof(link_state_t));
+    // Link costs of all nodes are kept contiguous. Neighbor lists are sized to
+    // the degree of each node, as advertised.
+    cost_t *link_costs = (cost_t *)calloc(num_nodes * num_nodes, sizeof(cost_t));
+    for (node_t n = 0; n < num_nodes; n++) {
+        state->link_states[n].link_cost = link_costs + n * num_nodes;
+    }
+    state->dist = (cost_t *)calloc(num_nodes, sizeof(cost_t));
+    state->pred = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->next_hop = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->first_child = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->next_sibling = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->prev_sibling = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->invalid = (int *)calloc(num_nodes, sizeof(int));
+    state->invalid_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->changed = (int *)calloc(num_nodes, sizeof(int));
+    state->changed_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->touched = (int *)calloc(num_nodes, sizeof(int));
+    state->touched_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->route_next_hop = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->route_cost = (cost_t *)calloc(num_nodes, sizeof(cost_t));
+    state->flooded = (int *)calloc(num_nodes, sizeof(int));
+    state->flood_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->flood_from = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->database_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->lsa_costs = (cost_t *)calloc(num_nodes, sizeof(cost_t));
+    state->queued = (int *)calloc(num_nodes, sizeof(int));
+    state->spf_delay = get_protocol_option("spf-delay", 0);
+    state->linear_scan = get_protocol_option("spf-linear-scan", 0);
+    if (!state->linear_scan) {
+        state->bucket_words = (num_nodes + 63) / 64;
+        state->buckets = (uint64_t *)calloc(COST_INFINITY * state->bucket_words, sizeof(uint64_t));
+    }
+
+    // The tree starts with just this node, and no routes.
+    for (node_t n = 0; n < num_nodes; n++) {
+        state->dist[n] = COST_INFINITY;
+        state->pred[n] = -1;
+        state->first_child[n] = -1;
+        state->route_next_hop[n] = -1;
+        state->route_cost[n] = COST_INFINITY;
+        state->lsa_costs[n] = COST_INFINITY;
+    }
+    state->dist[get_current_node()] = 0;
 
     for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
         state->link_states[n].version = 0;
 
         for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
 
-            if (n == get_current_node()) {  // If local node
-                state->link_states[n].link_cost[dest] = get_link_cost(dest);
-            }
-            else if (n == dest) { // If node to itself
+            if (n == dest) { // If node to itself
                 state->link_states[n].link_cost[dest] = 0;
             }
             else {
                 state->link_states[n].link_cost[dest] = COST_INFINITY;
             }
         }
+        if (n == get_current_node()) {  // If local node
+            for (neighbor_link_t link = get_first_neighbor_link(); link.neighbor >= 0; link = get_next_neighbor_link(link)) {
+                state->link_states[n].link_cost[link.neighbor] = link.cost;
+                add_in_neighbor(&state->link_states[link.neighbor], n);
+            }
+        }
+        update_neighbors(&state->link_states[n], n);
     }
+    // Our own links are relaxed on the first run.
+    state->changed[get_current_node()] = 1;
+    state->changed_nodes[state->num_changed++] = get_current_node();
     return state;
 }
 
+// Handler for the node to free its state.
+static void free_state(void *node_state) {
+    state_t *state = (state_t *)node_state;
+    for (node_t n = 0; n < get_num_nodes(); n++) {
+        free(state->link_states[n].neighbors);
+        free(state->link_states[n].in_neighbors);
+    }
+    free(state->link_states[0].link_cost);
+    free(state->link_states);
+    free(state->dist);
+    free(state->pred);
+    free(state->next_hop);
+    free(state->first_child);
+    free(state->next_sibling);
+    free(state->prev_sibling);
+    free(state->invalid);
+    free(state->invalid_nodes);
+    free(state->changed);
+    free(state->changed_nodes);
+    free(state->touched);
+    free(state->touched_nodes);
+    free(state->route_next_hop);
+    free(state->route_cost);
+    free(state->flooded);
+    free(state->flood_nodes);
+    free(state->flood_from);
+    free(state->database_nodes);
+    free(state->lsa_costs);
+    free(state->queued);
+    free(state->buckets);
+    free(state);
+}
 
-void broadcast_message(state_t *state) {
-    data_t outgoing_data;
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        if (get_link_cost(n) < COST_INFINITY && n != get_current_node()) {
-            memcpy(outgoing_data.ls, state->link_states, sizeof(outgoing_data.ls));
-            printf("BM: Node %d: Sending message to neighbor %d\n", get_current_node(), n);
-            send_message(n, &outgoing_data, sizeof(outgoing_data));
+
+// Neighbor queued advertisements came from once broadcast_message() sent them.
+#define FLOOD_SENT -2
+
+// Queue the advertisement of origin for flooding, received from neighbor from
+// or -1 if it must go to every neighbor. A newer copy replaces the neighbor an
+// older one came from, as that neighbor has yet to see it.
+static void flood_lsa(state_t *state, node_t origin, node_t from) {
+    state->flood_from[origin] = from;
+    if (!state->flooded[origin]) {
+        state->flooded[origin] = 1;
+        state->flood_nodes[state->num_flood++] = origin;
+    }
+}
+
+static size_t message_size(state_t *state, node_t *origins, int num_origins) {
+    size_t size = 0;
+    for (int i = 0; i < num_origins; i++) {
+        size += lsa_size(state->link_states[origins[i]].num_neighbors);
+    }
+    return size;
+}
+
+static void fill_message(state_t *state, node_t *origins, int num_origins, void *message) {
+    lsa_t *lsa = (lsa_t *)message;
+    for (int i = 0; i < num_origins; i++) {
+        link_state_t *link_state = &state->link_states[origins[i]];
+        lsa->origin = origins[i];
+        lsa->version = link_state->version;
+        lsa->num_links = link_state->num_neighbors;
+        for (int j = 0; j < link_state->num_neighbors; j++) {
+            lsa_links(lsa)[j].neighbor = link_state->neighbors[j];
+            lsa_links(lsa)[j].cost = link_state->link_cost[link_state->neighbors[j]];
         }
+        lsa = next_lsa(lsa);
     }
 }
 
-void run_dijkstra(state_t *state) {
-    node_t current_node = get_current_node();
-    cost_t dist[MAX_NODES];
-    int visited[MAX_NODES];
-    node_t pred[MAX_NODES];
+// Send the advertisements queued for flooding to every neighbor, leaving out
+// the ones each neighbor sent us. The advertisements from each neighbor, and
+// those from none, go out as one copy shared by the neighbors they go to.
+static void broadcast_message(state_t *state) {
+    for (int i = 0; i < state->num_flood; i++) {
+        node_t except = state->flood_from[state->flood_nodes[i]];
+        if (except == FLOOD_SENT) continue;
 
-    // Initialize distances, predecessors, and visited flags
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        dist[n] = state->link_states[current_node].link_cost[n];
-        visited[n] = 0;
-        pred[n] = current_node;
+        int num_lsas = 0;
+        for (int j = i; j < state->num_flood; j++) {
+            node_t origin = state->flood_nodes[j];
+            if (state->flood_from[origin] == except) {
+                state->flood_from[origin] = FLOOD_SENT;
+                state->database_nodes[num_lsas++] = origin;
+            }
+        }
+        size_t size = message_size(state, state->database_nodes, num_lsas);
+        fill_message(state, state->database_nodes, num_lsas, reserve_broadcast_except(except, size));
+        for (node_t n = get_first_neighbor(); n >= 0; n = get_next_neighbor(n)) {
+            if (n == except) continue;
+            LOG(LOG_INFO, "BM: Node %d: Sending message to neighbor %d\n", get_current_node(), n);
+        }
+        commit_message();
     }
-    dist[current_node] = 0;
+    for (int i = 0; i < state->num_flood; i++) {
+        state->flooded[state->flood_nodes[i]] = 0;
+    }
+    state->num_flood = 0;
+}
 
-    // Main loop to process all nodes
+// Send every known advertisement to a neighbor whose link just came up.
+static void send_database(state_t *state, node_t neighbor) {
+    int num_known = 0;
     for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        node_t u = -1;
-        cost_t min_cost = COST_INFINITY;
-
-        // Find the closest unvisited node
-        for (node_t candidate = get_first_node(); candidate <= get_last_node(); candidate = get_next_node(candidate)) {
-            if (!visited[candidate] && dist[candidate] < min_cost) {
-                u = candidate;
-                min_cost = dist[candidate];
-            }
+        if (state->link_states[n].version > 0) {
+            state->database_nodes[num_known++] = n;
         }
+    }
+    size_t size = message_size(state, state->database_nodes, num_known);
+    fill_message(state, state->database_nodes, num_known, reserve_message(neighbor, size));
+    LOG(LOG_INFO, "BM: Node %d: Sending message to neighbor %d\n", get_current_node(), neighbor);
+    commit_message();
+}
+
+// Run shortest path first and flood once the hold down expires, batching the
+// changes that arrive until then.
+static void schedule_update(state_t *state) {
+    if (!state->timer_set) {
+        state->timer_set = 1;
+        set_timer(state->spf_delay);
+    }
+}
 
-        if (u == -1) break; // No reachable unvisited nodes remain
-        visited[u] = 1;
+static void tree_link(state_t *state, node_t n, node_t parent) {
+    state->pred[n] = parent;
+    state->prev_sibling[n] = -1;
+    state->next_sibling[n] = state->first_child[parent];
+    if (state->first_child[parent] >= 0) {
+        state->prev_sibling[state->first_child[parent]] = n;
+    }
+    state->first_child[parent] = n;
+}
 
-        // Update distances for neighbors of the selected node
-        for (node_t neighbor = get_first_node(); neighbor <= get_last_node(); neighbor = get_next_node(neighbor)) {
-            if (!visited[neighbor] && state->link_states[u].link_cost[neighbor] < COST_INFINITY) {
-                cost_t alt = COST_ADD(dist[u], state->link_states[u].link_cost[neighbor]);
-                if (alt < dist[neighbor]) {
-                    dist[neighbor] = alt;
-                    pred[neighbor] = u;
-                }
-            }
+static void tree_unlink(state_t *state, node_t n) {
+    node_t parent = state->pred[n];
+    if (parent < 0) return;
+    if (state->prev_sibling[n] >= 0) {
+        state->next_sibling[state->prev_sibling[n]] = state->next_sibling[n];
+    } else {
+        state->first_child[parent] = state->next_sibling[n];
+    }
+    if (state->next_sibling[n] >= 0) {
+        state->prev_sibling[state->next_sibling[n]] = state->prev_sibling[n];
+    }
+    state->pred[n] = -1;
+}
+
+static void touch(state_t *state, node_t n) {
+    if (!state->touched[n]) {
+        state->touched[n] = 1;
+        state->touched_nodes[state->num_touched++] = n;
+    }
+}
+
+// Detach the subtree hanging off a node: its distances are no longer known.
+static void invalidate_subtree(state_t *state, node_t root) {
+    tree_unlink(state, root);
+    // The invalid list doubles as the stack of the traversal.
+    int first = state->num_invalid;
+    state->invalid[root] = 1;
+    state->invalid_nodes[state->num_invalid++] = root;
+    for (int i = first; i < state->num_invalid; i++) {
+        node_t n = state->invalid_nodes[i];
+        for (node_t child = state->first_child[n]; child >= 0; child = state->next_sibling[child]) {
+            state->pred[child] = -1;
+            state->invalid[child] = 1;
+            state->invalid_nodes[state->num_invalid++] = child;
         }
+        state->first_child[n] = -1;
+        state->dist[n] = COST_INFINITY;
+        touch(state, n);
     }
+}
 
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        if (n == current_node) continue;
+// Update one link cost in the database. Raising the cost of a tree link
+// invalidates the subtree below it; lowered costs are relaxed on the next run.
+static void update_link_cost(state_t *state, node_t origin, node_t n, cost_t cost) {
+    cost_t old_cost = state->link_states[origin].link_cost[n];
+    if (cost == old_cost) return;
+    state->link_states[origin].link_cost[n] = cost;
+    if (old_cost == COST_INFINITY) {
+        add_in_neighbor(&state->link_states[n], origin);
+    } else if (cost == COST_INFINITY) {
+        remove_in_neighbor(&state->link_states[n], origin);
+    }
+    if (cost > old_cost && state->pred[n] == origin) {
+        invalidate_subtree(state, n);
+    }
+    if (!state->changed[origin]) {
+        state->changed[origin] = 1;
+        state->changed_nodes[state->num_changed++] = origin;
+    }
+}
 
-        if (dist[n] == COST_INFINITY) {
-            // Remove route for unreachable node
-            set_route(n, -1, COST_INFINITY);
-            printf("Setting route from %d to %d as unreachable\n", current_node, n);
-        } else {
-            node_t next_hop = n;
-            node_t current = n;
+// Original selection of the closest node: scan all nodes.
+static void linear_queue_insert(state_t *state, node_t n) {
+    state->queued[n] = 1;
+}
 
-            while (pred[current] != current_node && pred[current] != -1) {
-                next_hop = pred[current];
-                current = pred[current];
-            }
+static void linear_queue_remove(state_t *state, node_t n) {
+    state->queued[n] = 0;
+}
+
+static node_t linear_queue_pop(state_t *state) {
+    node_t u = -1;
+    cost_t min_cost = COST_INFINITY;
+    for (node_t candidate = get_first_node(); candidate <= get_last_node(); candidate = get_next_node(candidate)) {
+        if (state->queued[candidate] && state->dist[candidate] < min_cost) {
+            u = candidate;
+            min_cost = state->dist[candidate];
+        }
+    }
+    if (u >= 0) state->queued[u] = 0;
+    return u;
+}
+
+// Dial's algorithm. Costs saturate at COST_INFINITY, so there is one bucket
+// per finite distance. Buckets are bitsets, so ties are broken by the lowest
+// node, like the linear scan.
+static void bucket_queue_insert(state_t *state, node_t n) {
+    cost_t cost = state->dist[n];
+    state->queued[n] = 1;
+    state->buckets[cost * state->bucket_words + n / 64] |= (uint64_t)1 << (n % 64);
+    if (cost < state->bucket || (cost == state->bucket && n / 64 < state->word)) {
+        state->bucket = cost;
+        state->word = n / 64;
+    }
+}
+
+static void bucket_queue_remove(state_t *state, node_t n) {
+    state->queued[n] = 0;
+    state->buckets[state->dist[n] * state->bucket_words + n / 64] &= ~((uint64_t)1 << (n % 64));
+}
+
+static node_t bucket_queue_pop(state_t *state) {
+    int words = state->bucket_words;
+    while (state->bucket < COST_INFINITY && state->buckets[state->bucket * words + state->word] == 0) {
+        if (++state->word == words) {
+            state->word = 0;
+            state->bucket++;
+        }
+    }
+    if (state->bucket == COST_INFINITY) return -1;
 
-            if (pred[current] != -1 && get_link_cost(next_hop) < COST_INFINITY) {
-                set_route(n, next_hop, dist[n]);
-                printf("Setting route from %d to %d via %d with cost %d\n", current_node, n, next_hop, dist[n]);
-            } else {
-                set_route(n, -1, COST_INFINITY);
-                printf("Setting route from %d to %d as unreachable\n", current_node, n);
+    uint64_t *bits = &state->buckets[state->bucket * words + state->word];
+    node_t u = state->word * 64 + __builtin_ctzll(*bits);
+    *bits &= *bits - 1;
+    state->queued[u] = 0;
+    return u;
+}
+
+static void queue_insert(state_t *state, node_t n) {
+    if (state->linear_scan) {
+        linear_queue_insert(state, n);
+    } else {
+        bucket_queue_insert(state, n);
+    }
+}
+
+static void queue_remove(state_t *state, node_t n) {
+    if (state->linear_scan) {
+        linear_queue_remove(state, n);
+    } else {
+        bucket_queue_remove(state, n);
+    }
+}
+
+static node_t queue_pop(state_t *state) {
+    return state->linear_scan ? linear_queue_pop(state) : bucket_queue_pop(state);
+}
+
+// Lower the distance of a node through a new parent and queue it for repair.
+static void relax(state_t *state, node_t u, node_t n, cost_t alt) {
+    if (state->queued[n]) {
+        queue_remove(state, n);
+    }
+    tree_unlink(state, n);
+    tree_link(state, n, u);
+    state->dist[n] = alt;
+    queue_insert(state, n);
+}
+
+static void relax_links(state_t *state, node_t u) {
+    link_state_t *link_state = &state->link_states[u];
+    for (int i = 0; i < link_state->num_neighbors; i++) {
+        node_t neighbor = link_state->neighbors[i];
+        cost_t alt = COST_ADD(state->dist[u], link_state->link_cost[neighbor]);
+        if (alt < state->dist[neighbor]) {
+            relax(state, u, neighbor, alt);
+        }
+    }
+}
+
+// Incremental shortest path first: repair the tree from the invalidated
+// subtrees and the nodes whose links changed, then update only the routes
+// that differ from the ones already set.
+static void run_dijkstra(state_t *state) {
+    node_t current_node = get_current_node();
+    state->bucket = COST_INFINITY;
+    state->word = 0;
+
+    // Reattach invalid nodes through their best valid neighbor, among the
+    // nodes with a link to them. Ties go to the lowest node.
+    for (int i = 0; i < state->num_invalid; i++) {
+        node_t n = state->invalid_nodes[i];
+        link_state_t *link_state = &state->link_states[n];
+        node_t best = -1;
+        cost_t best_cost = COST_INFINITY;
+        for (int j = 0; j < link_state->num_in_neighbors; j++) {
+            node_t u = link_state->in_neighbors[j];
+            if (state->invalid[u] || state->dist[u] == COST_INFINITY) continue;
+            cost_t alt = COST_ADD(state->dist[u], state->link_states[u].link_cost[n]);
+            if (alt < best_cost || (alt == best_cost && u < best)) {
+                best = u;
+                best_cost = alt;
             }
         }
+        if (best >= 0) {
+            tree_link(state, n, best);
+            state->dist[n] = best_cost;
+            queue_insert(state, n);
+        }
+    }
+    for (int i = 0; i < state->num_invalid; i++) {
+        state->invalid[state->invalid_nodes[i]] = 0;
     }
+    state->num_invalid = 0;
+
+    // Lowered link costs of settled nodes; queued nodes relax theirs when popped.
+    for (int i = 0; i < state->num_changed; i++) {
+        node_t u = state->changed_nodes[i];
+        if (state->dist[u] < COST_INFINITY && !state->queued[u]) {
+            relax_links(state, u);
+        }
+        state->changed[u] = 0;
+    }
+    state->num_changed = 0;
+
+    for (node_t u = queue_pop(state); u >= 0; u = queue_pop(state)) {
+        state->next_hop[u] = state->pred[u] == current_node ? u : state->next_hop[state->pred[u]];
+        touch(state, u);
+        relax_links(state, u);
+    }
+
+    for (int i = 0; i < state->num_touched; i++) {
+        node_t n = state->touched_nodes[i];
+        state->touched[n] = 0;
+        if (n == current_node) continue;
+
+        node_t next_hop = -1;
+        cost_t cost = COST_INFINITY;
+        if (state->dist[n] < COST_INFINITY && get_link_cost(state->next_hop[n]) < COST_INFINITY) {
+            next_hop = state->next_hop[n];
+            cost = state->dist[n];
+        }
+        if (next_hop == state->route_next_hop[n] && cost == state->route_cost[n]) continue;
+        state->route_next_hop[n] = next_hop;
+        state->route_cost[n] = cost;
 
+        set_route(n, next_hop, cost);
+        if (cost == COST_INFINITY) {
+            // Remove route for unreachable node
+            LOG(LOG_DEBUG, "Setting route from %d to %d as unreachable\n", current_node, n);
+        } else {
+            LOG(LOG_DEBUG, "Setting route from %d to %d via %d with cost %d\n", current_node, n, next_hop, cost);
+        }
+    }
+    state->num_touched = 0;
 }
 
 // Notify a node that a neighboring link has changed cost.
-void notify_link_change(node_t neighbor, cost_t new_cost) {
-    printf("LC: Node %d: Link to neighbor %d changed to cost %d\n", get_current_node(), neighbor, new_cost);
-    state_t *state = get_state();
+static void notify_link_change(node_t neighbor, cost_t new_cost) {
+    LOG(LOG_INFO, "LC: Node %d: Link to neighbor %d changed to cost %d\n", get_current_node(), neighbor, new_cost);
+    state_t *state = (state_t *)get_state();
     node_t current_node = get_current_node();
+    int link_up = state->link_states[current_node].link_cost[neighbor] == COST_INFINITY;
 
-    state->link_states[current_node].link_cost[neighbor] = new_cost;
+    update_link_cost(state, current_node, neighbor, new_cost);
+    update_neighbors(&state->link_states[current_node], current_node);
     state->link_states[current_node].version++;
-    printf("LC: Node %d: Updated link state version to %d\n", current_node, state->link_states[current_node].version);
+    LOG(LOG_DEBUG, "LC: Node %d: Updated link state version to %d\n", current_node, state->link_states[current_node].version);
 
-    run_dijkstra(state);
-    broadcast_message(state);
+    // A new neighbor gets the whole database now, which includes our own links.
+    flood_lsa(state, current_node, link_up ? neighbor : -1);
+    if (link_up && new_cost < COST_INFINITY) {
+        send_database(state, neighbor);
+    }
+    schedule_update(state);
+}
+
+// Replace the links of a node with the ones in an advertisement.
+static void update_link_state(state_t *state, lsa_t *lsa) {
+    link_state_t *link_state = &state->link_states[lsa->origin];
+    cost_t *lsa_costs = state->lsa_costs;
+    for (int i = 0; i < lsa->num_links; i++) {
+        lsa_costs[lsa_links(lsa)[i].neighbor] = lsa_links(lsa)[i].cost;
+    }
+    // Links missing from the advertisement are down.
+    for (int i = 0; i < link_state->num_neighbors; i++) {
+        node_t n = link_state->neighbors[i];
+        if (lsa_costs[n] == COST_INFINITY) {
+            update_link_cost(state, lsa->origin, n, COST_INFINITY);
+        }
+    }
+    reserve_neighbors(link_state, lsa->num_links);
+    link_state->num_neighbors = 0;
+    for (int i = 0; i < lsa->num_links; i++) {
+        node_t n = lsa_links(lsa)[i].neighbor;
+        update_link_cost(state, lsa->origin, n, lsa_costs[n]);
+        link_state->neighbors[link_state->num_neighbors++] = n;
+        lsa_costs[n] = COST_INFINITY;
+    }
+    link_state->version = lsa->version;
 }
 
 // Receive a message sent by a neighboring node.
-void notify_receive_message(node_t sender, void *message, size_t length) {
-    printf("RM: Node %d: Received message from node %d\n", get_current_node(), sender);
-    state_t *state = get_state();
-    data_t *received_data = (data_t *)message;
-    int updated = 0;
+static void notify_receive_message(node_t sender, void *message, size_t length) {
+    LOG(LOG_INFO, "RM: Node %d: Received message from node %d\n", get_current_node(), sender);
+    state_t *state = (state_t *)get_state();
 
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
+    for (lsa_t *lsa = (lsa_t *)message; (char *)lsa < (char *)message + length; lsa = next_lsa(lsa)) {
         //print versions
-        printf("\n");
-        printf("Node %d version(RECEIVED): %d\n", n, received_data->ls[n].version);
-        printf("Node %d version(STATE, should be smaller): %d\n", n, state->link_states[n].version);
-        if (received_data->ls[n].version > state->link_states[n].version) {
-            printf("More recent version received from node %d\n", sender);
-            state->link_states[n].version = received_data->ls[n].version;
-            state->link_states[n] = received_data->ls[n];
-            
-            for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-                state->link_states[n].link_cost[dest] = received_data->ls[n].link_cost[dest];
-            }
-            updated = 1;
+        LOG(LOG_TRACE, "\n");
+        LOG(LOG_TRACE, "Node %d version(RECEIVED): %d\n", lsa->origin, lsa->version);
+        LOG(LOG_TRACE, "Node %d version(STATE, should be smaller): %d\n", lsa->origin, state->link_states[lsa->origin].version);
+        if (lsa->version > state->link_states[lsa->origin].version) {
+            LOG(LOG_DEBUG, "More recent version received from node %d\n", sender);
+            update_link_state(state, lsa);
+            flood_lsa(state, lsa->origin, sender);
         }
     }
 
-    if (updated) {
-        // Run Dijkstra's algorithm to update routes
-        run_dijkstra(state);
-        printf("Running Dijkstra's algorithm\n");
-        broadcast_message(state);
-    }   
-}
\ No newline at end of file
+    if (state->num_flood > 0) {
+        schedule_update(state);
+    }
+}
+
+// Notify a node that a timer it set has expired.
+static void notify_timer() {
+    state_t *state = (state_t *)get_state();
+    state->timer_set = 0;
+
+    // Run Dijkstra's algorithm to update routes
+    run_dijkstra(state);
+    LOG(LOG_DEBUG, "Running Dijkstra's algorithm\n");
+    broadcast_message(state);
+}
+
+REGISTER_PROTOCOL("ls")
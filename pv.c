@@ -3,92 +3,336 @@
 \******************************************************************************/
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "routing-simulator.h"
 
-// Message format to send between nodes.
-typedef struct message_t {
-    cost_t data[MAX_NODES]; // The distance vector from the sender
-    node_t path[MAX_NODES][MAX_NODES]; // The path vector from the sender
-} message_t;
+// Paths are interned as cells holding a node followed by the path of another
+// cell, so that equal paths share a handle and are compared as integers.
+// Handle 0 is the empty path.
+typedef struct path_cell_t {
+    node_t node;
+    int tail;
+    int length;
+    int refs;
+    // Next cell in the same hash bucket, or in the free list.
+    int next;
+} path_cell_t;
 
 // State format.
-typedef struct state_t {
-    cost_t neighbor_costs[MAX_NODES][MAX_NODES]; // Cost to each destination via each neighbor
-    node_t paths[MAX_NODES][MAX_NODES][MAX_NODES]; // Paths to edach destination via each neighbor
+typedef struct pv_state_t {
+    // Rows kept for this node and each node that has been its neighbor, by
+    // slot: the cost and path to each destination via the node.
+    cost_t **neighbor_costs;
+    int **paths;
+    int *slots; // Slot of each node's rows, or -1
+    int num_slots;
+    // Interned paths, indexed by a hash of their first node and tail.
+    path_cell_t *cells;
+    int num_cells;
+    // Set of the nodes on each path, member_words words per cell.
+    uint64_t *members;
+    int member_words;
+    int free_cell;
+    int *buckets;
+    int num_buckets;
+    // Destinations whose cost or path changed since the last broadcast.
+    int *dirty;
+    node_t *dirty_nodes;
+    int num_dirty;
+    // Neighbors that missed broadcasts while their link was down, as all links
+    // are at first.
+    int *needs_full;
 } state_t;
 
-void broadcast_message(state_t *state) {
-    message_t message;
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        if (get_link_cost(n) < COST_INFINITY && n != get_current_node()) {
-            for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-                message.data[dest] = state->neighbor_costs[get_current_node()][dest];
-                memcpy(message.path[dest], state->paths[get_current_node()][dest], sizeof(message.path[dest]));
-            }
-            printf("BM: Node %d: Sending message to neighbor %d\n", get_current_node(), n);
-            send_message(n, &message, sizeof(message));
+// Allocate the rows kept for a node, the first time it is this node or a
+// neighbor. Costs start unknown, and paths empty.
+static int add_slot(state_t *state, node_t node) {
+    int num_nodes = get_num_nodes();
+    int slot = state->slots[node] = state->num_slots++;
+    state->neighbor_costs = (cost_t **)realloc(state->neighbor_costs, state->num_slots * sizeof(cost_t *));
+    state->paths = (int **)realloc(state->paths, state->num_slots * sizeof(int *));
+    state->neighbor_costs[slot] = (cost_t *)malloc(num_nodes * sizeof(cost_t));
+    memset(state->neighbor_costs[slot], COST_INFINITY, num_nodes * sizeof(cost_t));
+    state->neighbor_costs[slot][node] = 0;
+    state->paths[slot] = (int *)calloc(num_nodes, sizeof(int));
+    return slot;
+}
+
+// Slot of the rows kept for this node or a neighbor. Kept apart from
+// add_slot() so that lookups in the inner loops stay small enough to inline.
+static int node_slot(state_t *state, node_t node) {
+    return state->slots[node] >= 0 ? state->slots[node] : add_slot(state, node);
+}
+
+// Cost to each destination via a node.
+static cost_t *costs_of(state_t *state, node_t node) {
+    int slot = node_slot(state, node);
+    return state->neighbor_costs[slot];
+}
+
+// Path to each destination via a node.
+static int *paths_of(state_t *state, node_t node) {
+    int slot = node_slot(state, node);
+    return state->paths[slot];
+}
+
+// Message format to send between nodes: the path vector entries that changed
+// since the sender's previous message, each the destination, the cost and the
+// length of the path followed by its nodes. These are all 16 bit words, or 32
+// bit ones when there are more node IDs than 16 bits can name, as both ends
+// can tell from get_num_nodes().
+static size_t word_size() {
+    return get_num_nodes() > UINT16_MAX + 1 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+static void set_word(void *words, size_t word_size, int i, node_t value) {
+    if (word_size == sizeof(uint32_t)) {
+        ((uint32_t *)words)[i] = value;
+    } else {
+        ((uint16_t *)words)[i] = value;
+    }
+}
+
+static node_t get_word(const void *words, size_t word_size, int i) {
+    if (word_size == sizeof(uint32_t)) {
+        return ((const uint32_t *)words)[i];
+    }
+    return ((const uint16_t *)words)[i];
+}
+
+static size_t message_size(state_t *state, node_t *dests, int num_dests) {
+    size_t size = 0;
+    int *paths = paths_of(state, get_current_node());
+    for (int i = 0; i < num_dests; i++) {
+        size += 3 + state->cells[paths[dests[i]]].length;
+    }
+    return size * word_size();
+}
+
+static void fill_message(state_t *state, node_t *dests, int num_dests, void *message) {
+    size_t size = word_size();
+    int w = 0;
+    cost_t *costs = costs_of(state, get_current_node());
+    int *paths = paths_of(state, get_current_node());
+    for (int i = 0; i < num_dests; i++) {
+        int path = paths[dests[i]];
+        set_word(message, size, w++, dests[i]);
+        set_word(message, size, w++, costs[dests[i]]);
+        set_word(message, size, w++, state->cells[path].length);
+        for (; path != 0; path = state->cells[path].tail) {
+            set_word(message, size, w++, state->cells[path].node);
         }
     }
 }
-// Helper function to check if a path contains a cycle
-int contains_cycle(node_t *path, node_t node) {
-    for (int i = 0; i < MAX_NODES; i++) {
-        if (path[i] == -1) break; // End of path
-        if (path[i] == node) return 1; // Node is already in the path
+
+static int path_hash(state_t *state, node_t node, int tail) {
+    return ((unsigned)tail * 2654435761u + node) & (state->num_buckets - 1);
+}
+
+static uint64_t *path_members(state_t *state, int path) {
+    return state->members + path * state->member_words;
+}
+
+static int path_contains(state_t *state, int path, node_t node) {
+    return (path_members(state, path)[node / 64] >> (node % 64)) & 1;
+}
+
+static int path_ref(state_t *state, int path) {
+    state->cells[path].refs++;
+    return path;
+}
+
+static void path_release(state_t *state, int path) {
+    while (path != 0 && --state->cells[path].refs == 0) {
+        path_cell_t *cell = &state->cells[path];
+        int *link = &state->buckets[path_hash(state, cell->node, cell->tail)];
+        while (*link != path) link = &state->cells[*link].next;
+        *link = cell->next;
+        cell->next = state->free_cell;
+        state->free_cell = path;
+        path = cell->tail;
+    }
+}
+
+static void grow_path_table(state_t *state) {
+    int num_cells = state->num_cells;
+    state->num_cells *= 2;
+    state->cells = (path_cell_t *)realloc(state->cells, state->num_cells * sizeof(path_cell_t));
+    state->members = (uint64_t *)realloc(state->members, state->num_cells * state->member_words * sizeof(uint64_t));
+    for (int c = state->num_cells - 1; c >= num_cells; c--) {
+        state->cells[c].refs = 0;
+        state->cells[c].next = state->free_cell;
+        state->free_cell = c;
+    }
+    // Rehash the cells in use into twice the buckets.
+    state->num_buckets *= 2;
+    free(state->buckets);
+    state->buckets = (int *)calloc(state->num_buckets, sizeof(int));
+    for (int c = 1; c < num_cells; c++) {
+        path_cell_t *cell = &state->cells[c];
+        if (cell->refs == 0) continue;
+        int *bucket = &state->buckets[path_hash(state, cell->node, cell->tail)];
+        cell->next = *bucket;
+        *bucket = c;
+    }
+}
+
+// Get a reference to the path of node followed by tail.
+static int path_cons(state_t *state, node_t node, int tail) {
+    int *bucket = &state->buckets[path_hash(state, node, tail)];
+    for (int c = *bucket; c != 0; c = state->cells[c].next) {
+        if (state->cells[c].node == node && state->cells[c].tail == tail) {
+            return path_ref(state, c);
+        }
+    }
+
+    if (state->free_cell == 0) {
+        grow_path_table(state);
+        bucket = &state->buckets[path_hash(state, node, tail)];
+    }
+    int path = state->free_cell;
+    path_cell_t *cell = &state->cells[path];
+    state->free_cell = cell->next;
+    cell->node = node;
+    cell->tail = path_ref(state, tail);
+    cell->length = state->cells[tail].length + 1;
+    // The members of the tail, plus node.
+    memcpy(path_members(state, path), path_members(state, tail), state->member_words * sizeof(uint64_t));
+    path_members(state, path)[node / 64] |= 1ull << (node % 64);
+    cell->refs = 1;
+    cell->next = *bucket;
+    *bucket = path;
+    return path;
+}
+
+// Replace the path held in slot with a new reference.
+static void set_path(state_t *state, int *slot, int path) {
+    path_release(state, *slot);
+    *slot = path;
+}
+
+static void mark_dirty(state_t *state, node_t dest) {
+    if (!state->dirty[dest]) {
+        state->dirty[dest] = 1;
+        state->dirty_nodes[state->num_dirty++] = dest;
+    }
+}
+
+// Send the changed entries to every neighbor, and the whole path vector to
+// neighbors that may have missed some.
+static void broadcast_message(state_t *state) {
+    int num_full = 0;
+    node_t full_neighbor = -1;
+    for (node_t n = get_first_neighbor(); n >= 0; n = get_next_neighbor(n)) {
+        if (state->needs_full[n]) {
+            num_full++;
+            full_neighbor = n;
+        }
+    }
+
+    // One copy of the changes is shared by all other neighbors.
+    if (state->num_dirty > 0) {
+        size_t size = message_size(state, state->dirty_nodes, state->num_dirty);
+        node_t except = num_full == 1 ? full_neighbor : -1;
+        fill_message(state, state->dirty_nodes, state->num_dirty, reserve_broadcast_except(except, size));
+        commit_message();
+    }
+    for (int i = 0; i < state->num_dirty; i++) {
+        state->dirty[state->dirty_nodes[i]] = 0;
+    }
+    state->num_dirty = 0;
+
+    if (num_full > 0) {
+        int num_dests = 0;
+        for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
+            state->dirty_nodes[num_dests++] = dest;
+        }
+        size_t size = message_size(state, state->dirty_nodes, num_dests);
+        for (node_t n = get_first_neighbor(); n >= 0; n = get_next_neighbor(n)) {
+            if (!state->needs_full[n]) continue;
+            fill_message(state, state->dirty_nodes, num_dests, reserve_message(n, size));
+            commit_message();
+            state->needs_full[n] = 0;
+        }
+    }
+
+    for (node_t n = get_first_neighbor(); n >= 0; n = get_next_neighbor(n)) {
+        LOG(LOG_INFO, "BM: Node %d: Sending message to neighbor %d\n", get_current_node(), n);
     }
-    return 0;
 }
 
 // Initialize the state
-state_t *init_state() {
-    printf("Initializing node %d\n", get_current_node());
+static void *init_state() {
+    LOG(LOG_INFO, "Initializing node %d\n", get_current_node());
     state_t *state = (state_t *)calloc(1, sizeof(state_t));
+    int num_nodes = get_num_nodes();
+    state->slots = (int *)calloc(num_nodes, sizeof(int));
+    state->dirty = (int *)calloc(num_nodes, sizeof(int));
+    state->dirty_nodes = (node_t *)calloc(num_nodes, sizeof(node_t));
+    state->needs_full = (int *)calloc(num_nodes, sizeof(int));
+    // Cell 0 is the empty path, never freed nor hashed.
+    state->num_cells = 1;
+    state->num_buckets = 1;
+    state->cells = (path_cell_t *)calloc(1, sizeof(path_cell_t));
+    state->member_words = (num_nodes + 63) / 64;
+    state->members = (uint64_t *)calloc(state->member_words, sizeof(uint64_t));
+    state->buckets = (int *)calloc(1, sizeof(int));
+    while (state->num_cells < num_nodes) {
+        grow_path_table(state);
+    }
 
     for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-            if (n == dest) {
-                state->neighbor_costs[n][dest] = 0;
-            } else {
-                state->neighbor_costs[n][dest] = COST_INFINITY;
-            }
-            for (node_t next = get_first_node(); next <= get_last_node(); next = get_next_node(next)) {
-                state->paths[n][dest][next] = -1;
-            }
-        }
+        state->needs_full[n] = 1;
+        state->slots[n] = -1;
     }
+    node_slot(state, get_current_node());
     return state;
 }
 
+// Free the state
+static void free_state(void *node_state) {
+    state_t *state = (state_t *)node_state;
+    for (int slot = 0; slot < state->num_slots; slot++) {
+        free(state->neighbor_costs[slot]);
+        free(state->paths[slot]);
+    }
+    free(state->neighbor_costs);
+    free(state->paths);
+    free(state->slots);
+    free(state->cells);
+    free(state->members);
+    free(state->buckets);
+    free(state->dirty);
+    free(state->dirty_nodes);
+    free(state->needs_full);
+    free(state);
+}
+
 
 // Recalculate the distance vector using Bellman-Ford
-int recalculate_distance_vector(state_t *state) {
-    int updated = 0;
+static int recalculate_distance_vector(state_t *state) {
+    int paths_changed = 0;
     node_t current_node = get_current_node();
-
-    // copy current state->paths
-    node_t paths_copy[MAX_NODES][MAX_NODES][MAX_NODES];
-    memcpy(paths_copy, state->paths, sizeof(paths_copy));
+    cost_t *costs = costs_of(state, current_node);
+    int *paths = paths_of(state, current_node);
 
     for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
         if (dest == current_node) continue;
 
         cost_t best_cost = COST_INFINITY;
         node_t best_next_hop = -1;
-        node_t best_path[MAX_NODES];
-        memset(best_path, -1, sizeof(best_path)); // Reset the best path
-
-        for (node_t neighbor = get_first_node(); neighbor <= get_last_node(); neighbor = get_next_node(neighbor)) {
-            if (neighbor == current_node || get_link_cost(neighbor) >= COST_INFINITY) continue;
 
-            cost_t cost_via_neighbor = COST_ADD(get_link_cost(neighbor), state->neighbor_costs[neighbor][dest]);
+        for (neighbor_link_t link = get_first_neighbor_link(); link.neighbor >= 0; link = get_next_neighbor_link(link)) {
+            node_t neighbor = link.neighbor;
+            cost_t cost_via_neighbor = COST_ADD(link.cost, costs_of(state, neighbor)[dest]);
 
             // Skip paths that create cycles
-            if (contains_cycle(state->paths[neighbor][dest], current_node)) {
-                //printf("  Skipping path through %d to %d due to cycle\n", neighbor, dest);
+            if (path_contains(state, paths_of(state, neighbor)[dest], current_node)) {
+                //LOG(LOG_TRACE, "  Skipping path through %d to %d due to cycle\n", neighbor, dest);
                 continue;
             }
 
@@ -96,70 +340,71 @@ int recalculate_distance_vector(state_t *state) {
             if (cost_via_neighbor < best_cost) {
                 best_cost = cost_via_neighbor;
                 best_next_hop = neighbor;
-
-                // Construct the new path
-                memset(best_path, -1, sizeof(best_path)); // Reset path
-                best_path[0] = current_node;
-                int path_index = 1;
-                for (int i = 0; i < MAX_NODES && state->paths[neighbor][dest][i] != -1; i++) {
-                    best_path[path_index++] = state->paths[neighbor][dest][i];
-                }
             }
         }
 
+        // The new path goes through the best neighbor's path, if any.
+        int best_path = 0;
+        if (best_next_hop >= 0) {
+            best_path = path_cons(state, current_node, paths_of(state, best_next_hop)[dest]);
+        }
+
         // Update the state if the best cost or path changed
-        if (best_cost != state->neighbor_costs[current_node][dest] ||
-            memcmp(state->paths[current_node][dest], best_path, sizeof(best_path)) != 0) {
-            printf("  Updating path to %d: cost = %d, next hop = %d\n", dest, best_cost, best_next_hop);
-            state->neighbor_costs[current_node][dest] = best_cost;
-            memcpy(state->paths[current_node][dest], best_path, sizeof(best_path));
+        if (best_cost != costs[dest] || best_path != paths[dest]) {
+            LOG(LOG_DEBUG, "  Updating path to %d: cost = %d, next hop = %d\n", dest, best_cost, best_next_hop);
+            paths_changed |= best_path != paths[dest];
+            mark_dirty(state, dest);
+            costs[dest] = best_cost;
+            set_path(state, &paths[dest], best_path);
             set_route(dest, best_next_hop, best_cost);
-            updated = 1;
 
             // Print the new path
-            printf("  Path to %d is: ", dest);
-            for (int i = 0; i < MAX_NODES; i++) {
-                if (best_path[i] == -1) break;
-                printf("%d ", best_path[i]);
+            LOG(LOG_DEBUG, "  Path to %d is: ", dest);
+            for (int path = best_path; path != 0; path = state->cells[path].tail) {
+                LOG(LOG_DEBUG, "%d ", state->cells[path].node);
             }
-            printf("\n");
+            LOG(LOG_DEBUG, "\n");
+        } else {
+            path_release(state, best_path);
         }
     }
 
-    // if state->paths didnt change, return 0  
-    if (memcmp(paths_copy, state->paths, sizeof(paths_copy)) == 0) {
-        return 0;
-    }
-
-    return updated;
+    // Only changed paths are broadcast.
+    return paths_changed;
 }
 
 // Invalidate routes that use the specified neighbor
-void invalidate_route(node_t current_node, node_t neighbor) {
-    state_t *state = get_state();
+static void invalidate_route(node_t current_node, node_t neighbor) {
+    state_t *state = (state_t *)get_state();
     for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
         // Check if the path to the destination uses the neighbor
-        if (state->paths[current_node][dest][0] == neighbor) {
-            state->neighbor_costs[current_node][dest] = COST_INFINITY;
-            memset(state->paths[current_node][dest], -1, sizeof(state->paths[current_node][dest]));
+        int path = paths_of(state, current_node)[dest];
+        if (path != 0 && state->cells[path].node == neighbor) {
+            costs_of(state, current_node)[dest] = COST_INFINITY;
+            set_path(state, &paths_of(state, current_node)[dest], 0);
+            mark_dirty(state, dest);
             set_route(dest, -1, COST_INFINITY);
-            printf("Invalidating path to %d via %d\n", dest, neighbor);
+            LOG(LOG_DEBUG, "Invalidating path to %d via %d\n", dest, neighbor);
         }
     }
 }
 
 // Notify a node that a neighboring link has changed cost
-void notify_link_change(node_t neighbor, cost_t new_cost) {
-    state_t *state = get_state();
+static void notify_link_change(node_t neighbor, cost_t new_cost) {
+    state_t *state = (state_t *)get_state();
     node_t current_node = get_current_node();
-    printf("LC: Node %d: Link to neighbor %d changed to cost %d\n", current_node, neighbor, new_cost);
+    LOG(LOG_INFO, "LC: Node %d: Link to neighbor %d changed to cost %d\n", current_node, neighbor, new_cost);
 
     // Update the link cost
-    state->neighbor_costs[current_node][neighbor] = new_cost;
+    if (costs_of(state, current_node)[neighbor] != new_cost) {
+        costs_of(state, current_node)[neighbor] = new_cost;
+        mark_dirty(state, neighbor);
+    }
 
     // Invalidate paths if the link is removed
     if (new_cost == COST_INFINITY) {
         invalidate_route(current_node, neighbor);
+        state->needs_full[neighbor] = 1;
     }
 
     // Recalculate the distance vector
@@ -170,20 +415,25 @@ void notify_link_change(node_t neighbor, cost_t new_cost) {
 }
 
 // Receive a message sent by a neighboring node
-void notify_receive_message(node_t sender, void *message, size_t length) {
-    state_t *state = get_state();
-    message_t *received_message = (message_t *)message;
-
-    // Update route costs
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        state->neighbor_costs[sender][n] = received_message->data[n];
-    }
+static void notify_receive_message(node_t sender, void *message, size_t length) {
+    state_t *state = (state_t *)get_state();
 
-    // Update paths from sender to every destination
-    for (node_t n = get_first_node(); n <= get_last_node(); n = get_next_node(n)) {
-        for (node_t dest = get_first_node(); dest <= get_last_node(); dest = get_next_node(dest)) {
-            state->paths[sender][n][dest] = received_message->path[n][dest];
+    // Update the costs and paths from sender to the destinations that changed,
+    // interning the paths from the last node back.
+    size_t size = word_size();
+    int num_words = length / size;
+    for (int w = 0; w < num_words;) {
+        node_t dest = get_word(message, size, w++);
+        costs_of(state, sender)[dest] = get_word(message, size, w++);
+        int path_length = get_word(message, size, w++);
+        int path = 0;
+        for (int i = path_length - 1; i >= 0; i--) {
+            int longer = path_cons(state, get_word(message, size, w + i), path);
+            path_release(state, path);
+            path = longer;
         }
+        set_path(state, &paths_of(state, sender)[dest], path);
+        w += path_length;
     }
 
     // Recalculate the distance vector
@@ -192,3 +442,8 @@ void notify_receive_message(node_t sender, void *message, size_t length) {
         broadcast_message(state);
     }
 }
+
+// Notify a node that a timer it set has expired. No timers are set.
+static void notify_timer() {}
+
+REGISTER_PROTOCOL("pv")
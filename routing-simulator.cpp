@@ -8,16 +8,35 @@
 #include "routing-simulator.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 // Initial set of node colors. Subsequent colors chosen randomly.
-static std::map<node_t, std::string> colors = {
+static const std::map<node_t, std::string> initial_colors = {
     {0, "/set19/1"}, {1, "/set19/2"}, {2, "/set19/3"},
     {3, "/set19/4"}, {4, "/set19/5"}, {5, "/set19/6"},
     {6, "/set19/7"}, {7, "/set19/8"}, {8, "/set19/9"},
@@ -25,15 +44,10 @@ static std::map<node_t, std::string> colors = {
 #define COLOR_CURRENT_MESSAGE "black"
 #define COLOR_FUTURE_MESSAGE "gray"
 
-// Command-line flags.
-static bool show_future_messages = true;
-static bool show_messages = true;
-static node_t show_routes_for = -1;
-static long max_events = -1;
-// Flag to output each step, or only one per epoch.
-static bool epoch_steps = false;
+// Most threads of a simulation, and simulations running at once.
+static const int MAX_THREADS = 256;
 
-enum event_type_t { LINK_CHANGE, MESSAGE };
+enum event_type_t { LINK_CHANGE, MESSAGE, TIMER };
 typedef struct {
   event_type_t type;
 
@@ -50,196 +64,890 @@ typedef struct {
       void *content;
       int length;
     } message;
+
+    struct {
+      node_t node;
+    } timer;
   };
 } event_t;
 
-// Ordered sequence of events to process.
-static std::multimap<event_time_t, event_t> events;
-// Unique set of all nodes in network.
-static std::set<node_t> nodes;
-// Network topology: map[link] -> cost.
-// Undirected graph, first node always < second.
-static std::map<std::pair<node_t, node_t>, cost_t> topology;
-// Router set routes: map[source][destination] -> <neighbor, route cost>
-static std::map<node_t, std::map<node_t, std::pair<node_t, cost_t>>> routes;
-// Node black box state.
-static std::map<node_t, state_t *> node_states;
-
-static std::ifstream topology_file;
-static std::ofstream steps_dot_file;
-static std::ofstream final_dot_file;
-
-// Current event context.
-static node_t current_node;
-static event_time_t current_time = -1;
-static bool changed = false;
-
-// Simulation stats
-static long num_events = 0;
-static long num_link_changes = 0;
-static long num_messages = 0;
-
-static cost_t get_topology_cost(node_t first_node, node_t second_node) {
-  // Avoid data duplication in undirected network graph.
-  if (first_node > second_node) {
-    std::swap(first_node, second_node);
+// Ordered sequence of events to process, bucketed by epoch.
+// Nearly every event is a message for the next epoch, so each epoch is a plain
+// vector appended to in FIFO order and only the sparse set of pending epochs
+// goes through the ordered index.
+// Results depend on the order of events within an epoch, which every engine
+// must reproduce: link changes in topology file order, then the events
+// scheduled by each event in the order it was processed in, each in the order
+// its handler scheduled them.
+class event_queue_t {
+public:
+  bool empty() const { return buckets.empty(); }
+
+  // Time and contents of the next event to process.
+  event_time_t front_time() const { return buckets.begin()->first; }
+  const event_t &front() const { return buckets.begin()->second[head]; }
+
+  void push(event_time_t time, const event_t &event) {
+    if (tail == nullptr || tail_time != time) {
+      auto bucket = buckets.find(time);
+      if (bucket == buckets.end()) {
+        // Reuse the storage of the last drained epoch.
+        bucket = buckets.emplace(time, std::move(spare)).first;
+        spare = std::vector<event_t>();
+      }
+      tail = &bucket->second;
+      tail_time = time;
+    }
+    tail->push_back(event);
+  }
+
+  void pop() {
+    auto bucket = buckets.begin();
+    if (++head < bucket->second.size()) {
+      return;
+    }
+
+    // Epoch drained, keep its storage for a future one.
+    if (tail == &bucket->second) {
+      tail = nullptr;
+    }
+    spare = std::move(bucket->second);
+    spare.clear();
+    buckets.erase(bucket);
+    head = 0;
+  }
+
+  // Visit all pending events in processing order.
+  template <typename F> void for_each(F visit) const {
+    size_t first = head;
+    for (auto &bucket : buckets) {
+      for (size_t e = first; e < bucket.second.size(); ++e) {
+        visit(bucket.second[e]);
+      }
+      first = 0;
+    }
+  }
+
+private:
+  std::map<event_time_t, std::vector<event_t>> buckets;
+  // Position of the next event within the earliest epoch.
+  size_t head = 0;
+  // Epoch most recently pushed to, to skip the index lookup.
+  std::vector<event_t> *tail = nullptr;
+  event_time_t tail_time = 0;
+  std::vector<event_t> spare;
+};
+
+// Bump allocator for message payloads. Memory is handed out from large chunks
+// that are kept across reset(), which releases every payload at once.
+class payload_arena_t {
+public:
+  ~payload_arena_t() {
+    for (auto &chunk : chunks) {
+      free(chunk.data);
+    }
+  }
+
+  void *allocate(size_t length) {
+    // Keep payloads suitably aligned for any message struct.
+    size_t size = (length + alignof(max_align_t) - 1) &
+                  ~(alignof(max_align_t) - 1);
+
+    while (current < chunks.size() &&
+           chunks[current].size - offset < size) { // Skip full chunks.
+      ++current;
+      offset = 0;
+    }
+    if (current == chunks.size()) {
+      chunk_t chunk;
+      chunk.size = std::max(size, CHUNK_SIZE);
+      chunk.data = (char *)malloc(chunk.size);
+      assert(chunk.data && "Out of memory for message payloads.");
+      chunks.push_back(chunk);
+      offset = 0;
+    }
+
+    void *payload = chunks[current].data + offset;
+    offset += size;
+    used_bytes += size;
+    return payload;
   }
 
+  void reset() {
+    current = 0;
+    offset = 0;
+    used_bytes = 0;
+  }
+
+  size_t used() const { return used_bytes; }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+  struct chunk_t {
+    char *data;
+    size_t size;
+  };
+  std::vector<chunk_t> chunks;
+  // Chunk being allocated from, and bytes already taken from it.
+  size_t current = 0;
+  size_t offset = 0;
+  size_t used_bytes = 0;
+};
+// Fixed set of threads that run tasks together with the calling thread.
+class worker_pool_t {
+public:
+  ~worker_pool_t() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  void start(int num_workers) {
+    for (int worker = 1; worker < num_workers; ++worker) {
+      threads.emplace_back([this, worker] { work(worker); });
+    }
+  }
+
+  // Run task(worker) on every worker, the calling thread being worker 0, and
+  // wait for all of them to finish.
+  void run(const std::function<void(int)> &run_task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      task = &run_task;
+      busy = threads.size();
+      ++generation;
+    }
+    wake.notify_all();
+    run_task(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+  }
+
+private:
+  void work(int worker) {
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      lock.unlock();
+      (*task)(worker);
+      lock.lock();
+      if (--busy == 0) {
+        done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(int)> *task = nullptr;
+  unsigned long generation = 0;
+  size_t busy = 0;
+  bool stopping = false;
+};
+// Network topology: every link that appears in the topology file, with its
+// current cost. Undirected graph, first node always < second, links sorted.
+typedef struct {
+  node_t first_node;
+  node_t second_node;
+  cost_t cost;
+} link_t;
+// Links of each node: those of node n are adjacency[adjacency_offsets[n]] up to
+// adjacency[adjacency_offsets[n + 1]], sorted by neighbor.
+typedef struct {
+  node_t neighbor;
+  int link; // Index in topology.
+} adjacency_t;
+// Router set routes: routes[source * number of nodes + destination].
+typedef struct {
+  node_t next_hop;
+  cost_t cost;
+  bool valid;
+} route_t;
+static const route_t NO_ROUTE = {-1, COST_INFINITY, false};
+// Routes and links changed since the last delta snapshot, with what they were
+// then, tracked when steps are dumped as deltas. The routes of a node are only
+// set by the worker handling it, so each worker keeps its own list, while
+// links only change on the main thread.
+typedef struct {
+  size_t route; // Index in routes.
+  route_t last;
+} dirty_route_t;
+typedef struct {
+  int link; // Index in topology.
+  cost_t last;
+} dirty_link_t;
+
+// Event scheduled by a handler running in parallel, to be merged in the order
+// of the event being handled.
+typedef struct {
+  size_t index;
+  event_time_t time;
+  event_t event;
+} scheduled_event_t;
+
+// Final stats of a protocol simulation.
+typedef struct {
+  const char *protocol;
+  size_t nodes;
+  long events;
+  long link_changes;
+  long messages;
+  long timers;
+  event_time_t epochs;
+  size_t peak_payload_bytes;
+  double seconds;
+} report_t;
+
+// Error that stops a simulation, such as an unreadable topology file.
+class simulation_error_t : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Protocols linked in, as registered by their modules. Modules register during
+// static initialization, so the list is created on first use.
+static std::vector<const protocol_t *> &protocols() {
+  static std::vector<const protocol_t *> protocols;
+  return protocols;
+}
+
+// One simulation of the selected protocols on a topology, with its own flags,
+// network, events and stats, so that several can run at once. The router API
+// acts on the simulation running on the calling thread.
+class simulation_t {
+public:
+  // Reports are written to out, and errors found while verifying to err.
+  simulation_t(std::ostream &out, std::ostream &err) : out(out), err(err) {}
+  ~simulation_t() {
+    if (topology_fd >= 0) {
+      close(topology_fd);
+    }
+  }
+
+  // Set the flags from command-line arguments, returning false if they are
+  // not valid.
+  bool parse_arguments(const std::vector<std::string> &args);
+
+  // Simulate each selected protocol in turn, returning the exit status.
+  // Throws simulation_error_t if the topology or dot files cannot be used.
+  int run();
+
+  const std::vector<report_t> &get_reports() const { return reports; }
+
+  // Router API, for the router module of the current node.
+  event_time_t get_current_time() const { return current_time; }
+  int log_enabled(int level) const;
+  void *get_state() const;
+  int get_protocol_option(const char *name, int default_value) const;
+  int get_num_nodes() const { return node_ids.size(); }
+  node_t get_first_neighbor() const;
+  node_t get_next_neighbor(node_t neighbor) const;
+  neighbor_link_t get_first_neighbor_link() const;
+  neighbor_link_t get_next_neighbor_link(neighbor_link_t link) const;
+  cost_t get_link_cost(node_t neighbor) const;
+  void set_route(node_t destination, node_t next_hop, cost_t cost);
+  void *reserve_message(node_t neighbor, size_t length);
+  void *reserve_broadcast_except(node_t neighbor, size_t length);
+  void commit_message();
+  void set_timer(event_time_t delay);
+
+private:
+  cost_t get_topology_cost(node_t first_node, node_t second_node) const;
+  void set_topology_cost(node_t first_node, node_t second_node, cost_t cost);
+  neighbor_link_t find_neighbor_link(node_t node, int entry) const;
+  bool is_node(node_t node) const;
+  void make_color(node_t node);
+  void schedule_topology_events();
+  void load_topology_events();
+  void free_node_states();
+  void init_node_states();
+  void dump_network_snapshot(std::ostream &dot_file, bool delta = false);
+  payload_arena_t &payload_arena(int worker, event_time_t time);
+  size_t payload_bytes_used() const;
+  void *allocate_payload(size_t length);
+  void schedule_event(event_time_t time, const event_t &event);
+  void process_event(event_t event);
+  void dump_step();
+  void process_epoch_in_parallel();
+  void process_events();
+  std::vector<std::pair<std::string, long>> deterministic_stats() const;
+  void reset_simulation();
+  bool verify_sequential_run();
+  void report_stats();
+
+  std::ostream &out;
+  std::ostream &err;
+
+  // Command-line flags.
+  bool show_future_messages = true;
+  bool show_messages = true;
+  node_t show_routes_for = -1;
+  int log_level = LOG_TRACE;
+  node_t log_node = -1;
+  long max_events = -1;
+  int num_threads = 1;
+  bool verify_against_sequential = false;
+  // Protocols to simulate in turn, on the same topology.
+  std::vector<const protocol_t *> selected_protocols;
+  // Options for the router modules, see get_protocol_option().
+  std::map<std::string, int> protocol_options;
+  // Flag to output each step, or only one per epoch.
+  bool epoch_steps = false;
+  // Steps to output: every steps_every-th one within the steps range of epochs,
+  // only showing what changed since the previous one with steps_delta.
+  bool steps_dot = false;
+  long steps_every = 1;
+  event_time_t steps_first = 0;
+  event_time_t steps_last = -1;
+  bool steps_delta = false;
+  std::string topology_file_name;
+  std::string steps_dot_file_name = "/dev/null";
+  std::string final_dot_file_name = "/dev/null";
+
+  std::map<node_t, std::string> colors = initial_colors;
+  // Generator of the other colors, one per simulation so that manifest jobs
+  // get the same colors whichever thread runs them. Seeded with 1, as rand()
+  // is by default.
+  std::minstd_rand color_random{1};
+
+  event_queue_t events;
+  // Message payloads, one arena per worker thread and epoch parity. Messages
+  // are always delivered during the epoch after they are sent, so the arenas
+  // for an epoch can be reset as soon as that epoch has been processed.
+  std::vector<payload_arena_t> payload_arenas;
+  worker_pool_t workers;
+  // Topology file ID of each node, in ascending order. Nodes are numbered
+  // densely by their position here, and only IDs shown to the user are mapped
+  // back.
+  std::vector<node_t> node_ids;
+  std::vector<link_t> topology;
+  std::vector<int> adjacency_offsets;
+  std::vector<adjacency_t> adjacency;
+  // Index in adjacency of each (node, neighbor) pair.
+  std::unordered_map<uint64_t, int> adjacency_index;
+  std::vector<route_t> routes;
+  bool track_changes = false;
+  std::vector<uint8_t> route_dirty, link_dirty;
+  std::vector<std::vector<dirty_route_t>> dirty_routes;
+  std::vector<dirty_link_t> dirty_links;
+  // Node black box state.
+  std::vector<void *> node_states;
+  // Protocol being simulated.
+  const protocol_t *protocol = nullptr;
+
+  int topology_fd = -1;
+  std::ofstream steps_dot_file;
+  std::ofstream final_dot_file;
+
+  // Link change events from the topology file, kept to start over from if
+  // simulating more than once.
+  std::vector<std::pair<event_time_t, event_t>> topology_events;
+
+  // Current epoch, and whether the network changed since the last step.
+  event_time_t current_time = -1;
+  std::atomic<bool> changed{false};
+
+  // Simulation stats
+  long num_events = 0;
+  std::atomic<long> num_link_changes{0};
+  std::atomic<long> num_messages{0};
+  std::atomic<long> num_timers{0};
+  size_t peak_payload_bytes = 0;
+  double simulation_seconds = 0;
+  std::vector<report_t> reports;
+
+  // Steps taken so far, to only output every steps_every-th one.
+  long num_steps = 0;
+  // Epoch of the last step taken, when only taking one per epoch.
+  event_time_t last_snapshot_epoch = -1;
+
+  // Reused by process_epoch_in_parallel(): the events of the epoch grouped by
+  // node, and the events each worker scheduled, merged back in order.
+  std::vector<event_t> batch;
+  std::vector<size_t> node_offsets, order;
+  std::vector<node_t> group_nodes;
+  std::vector<std::vector<scheduled_event_t>> worker_scheduled;
+  std::vector<size_t> index_offsets;
+  std::vector<const scheduled_event_t *> merged;
+  // Reused by dump_network_snapshot() to collect the changed routes.
+  std::vector<dirty_route_t> delta_routes;
+};
+
+// Message reserved by the router module and not yet committed.
+// Neighbor is -1 for broadcasts, which skip the excepted neighbor.
+static thread_local void *reserved_content = nullptr;
+static thread_local size_t reserved_length;
+static thread_local node_t reserved_neighbor;
+static thread_local node_t reserved_except;
+
+// Current event context. Every thread handles events of its own node, for the
+// simulation it is running.
+static thread_local simulation_t *current_simulation = nullptr;
+static thread_local node_t current_node;
+static thread_local int current_worker = 0;
+// Where events scheduled by the handler are kept, if running in parallel, with
+// the index of the event being handled.
+static thread_local std::vector<scheduled_event_t> *scheduled = nullptr;
+static thread_local size_t scheduled_index;
+
+static uint64_t adjacency_key(node_t node, node_t neighbor) {
+  return ((uint64_t)(uint32_t)node << 32) | (uint32_t)neighbor;
+}
+
+cost_t simulation_t::get_topology_cost(node_t first_node,
+                                       node_t second_node) const {
   if (first_node == second_node) {
     return 0;
-  } else if (topology.count(std::make_pair(first_node, second_node))) {
-    return topology[std::make_pair(first_node, second_node)];
+  }
+
+  auto entry = adjacency_index.find(adjacency_key(first_node, second_node));
+  if (entry != adjacency_index.end()) {
+    return topology[adjacency[entry->second].link].cost;
   } else {
     return COST_INFINITY;
   }
 }
 
-static void set_topology_cost(node_t first_node, node_t second_node,
-                              cost_t cost) {
+void simulation_t::set_topology_cost(node_t first_node, node_t second_node,
+                                     cost_t cost) {
   assert(first_node != second_node && "Setting cost of self-edge.");
-  // Avoid data duplication in undirected network graph.
-  if (first_node > second_node) {
-    std::swap(first_node, second_node);
+  auto entry = adjacency_index.find(adjacency_key(first_node, second_node));
+  assert(entry != adjacency_index.end() && "Setting cost of unknown link.");
+
+  int link = adjacency[entry->second].link;
+  if (track_changes && !link_dirty[link]) {
+    link_dirty[link] = 1;
+    dirty_links.push_back({link, topology[link].cost});
   }
+  topology[link].cost = cost;
+}
 
-  topology[std::make_pair(first_node, second_node)] = cost;
+// Find the first link of node to a neighbor, at or after position entry in
+// adjacency.
+neighbor_link_t simulation_t::find_neighbor_link(node_t node, int entry) const {
+  for (; entry < adjacency_offsets[node + 1]; ++entry) {
+    cost_t cost = topology[adjacency[entry].link].cost;
+    if (cost < COST_INFINITY) {
+      return {adjacency[entry].neighbor, cost, entry};
+    }
+  }
+  return {-1, COST_INFINITY, entry};
 }
 
-static void make_color(node_t node) {
+bool simulation_t::is_node(node_t node) const {
+  return node >= 0 && node < (node_t)node_ids.size();
+}
+
+void simulation_t::make_color(node_t node) {
   if (!colors.count(node)) { // Generate new color if not already defined.
     // Random hue, full saturation and value.
-    colors[node] = std::to_string((float)rand() / RAND_MAX) + " 1.0 1.0";
+    colors[node] = std::to_string((float)color_random() / color_random.max()) +
+                   " 1.0 1.0";
   }
 }
 
-static void load_topology_events() {
-  std::string line;
-  // Iterate file lines.
-  while (std::getline(topology_file, line)) {
-    std::istringstream iss(line);
+void simulation_t::schedule_topology_events() {
+  for (auto &event : topology_events) {
+    events.push(event.first, event.second);
+  }
+}
+
+// Skip white space other than newlines in a topology file line.
+static const char *skip_blanks(const char *text, const char *end) {
+  while (text < end && (*text == ' ' || *text == '\t' || *text == '\r' ||
+                        *text == '\v' || *text == '\f')) {
+    ++text;
+  }
+  return text;
+}
+
+// Read a decimal integer from a topology file line, after any blanks, and
+// advance past it. Returns false if there is none or it does not fit in a long.
+static bool read_integer(const char *&text, const char *end, long &value) {
+  const char *digit = skip_blanks(text, end);
+  bool negative = false;
+  if (digit < end && (*digit == '-' || *digit == '+')) {
+    negative = *digit++ == '-';
+  }
+  if (digit == end || *digit < '0' || *digit > '9') {
+    return false;
+  }
+  unsigned long magnitude = 0;
+  for (; digit < end && *digit >= '0' && *digit <= '9'; ++digit) {
+    if (magnitude > (LONG_MAX - 9) / 10) {
+      return false;
+    }
+    magnitude = magnitude * 10 + (*digit - '0');
+  }
+  value = negative ? -(long)magnitude : (long)magnitude;
+  text = digit;
+  return true;
+}
+
+void simulation_t::load_topology_events() {
+  // Link changes as read from the file, with topology file node IDs, and then
+  // with dense node numbers.
+  struct link_event_t {
     event_time_t time;
     node_t first_node, second_node;
-    unsigned cost_int; // Used to read cost as a number and not a char.
-    // Parse line.
-    if (!(iss >> time >> first_node >> second_node >> cost_int)) {
-      std::cerr << "Syntax error in topology file." << std::endl;
-      exit(EXIT_FAILURE);
+    cost_t cost;
+  };
+  std::vector<link_event_t> link_events;
+
+  // Map the whole file to parse it in place.
+  struct stat file_stat;
+  if (fstat(topology_fd, &file_stat) != 0) {
+    throw simulation_error_t("Error reading topology file.");
+  }
+  size_t size = file_stat.st_size;
+  const char *text = nullptr;
+  if (size > 0) {
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, topology_fd, 0);
+    if (mapping == MAP_FAILED) {
+      throw simulation_error_t("Error reading topology file.");
     }
-    cost_t cost = cost_int > COST_INFINITY ? COST_INFINITY : cost_int;
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    text = (const char *)mapping;
+  }
+  const char *end = text + size;
+  link_events.reserve(std::count(text, end, '\n') + 1);
 
-    // Insert two link change events, one for each side of the link.
-    event_t event;
-    event.type = LINK_CHANGE;
-    event.link_change.node = first_node;
-    event.link_change.neighbor = second_node;
-    event.link_change.new_cost = cost;
-    events.insert(std::make_pair(time, event));
-    event.link_change.node = second_node;
-    event.link_change.neighbor = first_node;
-    events.insert(std::make_pair(time, event));
+  node_t min_id = INT_MAX, max_id = INT_MIN;
+  // Iterate file lines: <time> <first-node> <second-node> <cost>, ignoring
+  // anything after.
+  long line_number = 0;
+  for (const char *line = text; line < end;) {
+    ++line_number;
+    const char *line_end = (const char *)memchr(line, '\n', end - line);
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    long time, first_node, second_node, cost;
+    if (!read_integer(line, line_end, time) ||
+        !read_integer(line, line_end, first_node) ||
+        !read_integer(line, line_end, second_node) ||
+        !read_integer(line, line_end, cost) || time < INT_MIN ||
+        time > INT_MAX || first_node < INT_MIN || first_node > INT_MAX ||
+        second_node < INT_MIN || second_node > INT_MAX) {
+      munmap((void *)text, size);
+      throw simulation_error_t("Syntax error in topology file on line " +
+                               std::to_string(line_number) + ".");
+    }
+    link_events.push_back(
+        {(event_time_t)time, (node_t)first_node, (node_t)second_node,
+         cost < 0 || cost > COST_INFINITY ? (cost_t)COST_INFINITY
+                                          : (cost_t)cost});
+    min_id = std::min({min_id, (node_t)first_node, (node_t)second_node});
+    max_id = std::max({max_id, (node_t)first_node, (node_t)second_node});
+    line = line_end + 1;
+  }
+  if (size > 0) {
+    munmap((void *)text, size);
+  }
+  close(topology_fd);
+  topology_fd = -1;
 
-    // Keep track of known nodes.
-    nodes.insert(first_node);
-    nodes.insert(second_node);
+  // Number nodes densely, in order of their IDs. IDs are looked up in a table
+  // over their range, unless it is sparse, then in a hash map.
+  std::vector<node_t> id_table;
+  std::unordered_map<node_t, node_t> id_map;
+  bool dense = !link_events.empty() &&
+               (int64_t)max_id - min_id < 4 * (int64_t)link_events.size();
+  if (dense) {
+    id_table.assign((int64_t)max_id - min_id + 1, -1);
+    for (auto &link : link_events) {
+      id_table[link.first_node - min_id] = 0;
+      id_table[link.second_node - min_id] = 0;
+    }
+    for (size_t id = 0; id < id_table.size(); ++id) {
+      if (id_table[id] == 0) {
+        id_table[id] = node_ids.size();
+        node_ids.push_back(min_id + id);
+      }
+    }
+  } else {
+    for (auto &link : link_events) {
+      node_ids.push_back(link.first_node);
+      node_ids.push_back(link.second_node);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+    node_ids.erase(std::unique(node_ids.begin(), node_ids.end()),
+                   node_ids.end());
+    for (node_t node = 0; node < (node_t)node_ids.size(); ++node) {
+      id_map[node_ids[node]] = node;
+    }
+  }
+  auto node_index = [&](node_t id) {
+    return dense ? id_table[id - min_id] : id_map[id];
+  };
 
-    // Generate colors for the nodes, as needed.
-    make_color(first_node);
-    make_color(second_node);
+  // Generate colors for the nodes, as needed, in order of appearance.
+  std::vector<bool> colored(node_ids.size(), false);
+  for (auto &link : link_events) {
+    link.first_node = node_index(link.first_node);
+    link.second_node = node_index(link.second_node);
+    for (node_t node : {link.first_node, link.second_node}) {
+      if (!colored[node]) {
+        colored[node] = true;
+        make_color(node_ids[node]);
+      }
+    }
   }
 
-  // Initialize network costs.
-  for (auto first_node : nodes) {
-    for (auto second_node : nodes) {
-      if (first_node < second_node) {
-        set_topology_cost(first_node, second_node, COST_INFINITY);
+  // Collect the links, all initially down.
+  std::unordered_set<uint64_t> known_links;
+  for (auto &link : link_events) {
+    node_t first_node = std::min(link.first_node, link.second_node);
+    node_t second_node = std::max(link.first_node, link.second_node);
+    if (first_node != second_node &&
+        known_links.insert(adjacency_key(first_node, second_node)).second) {
+      topology.push_back({first_node, second_node, COST_INFINITY});
+    }
+  }
+  std::sort(topology.begin(), topology.end(),
+            [](const link_t &a, const link_t &b) {
+              return std::make_pair(a.first_node, a.second_node) <
+                     std::make_pair(b.first_node, b.second_node);
+            });
+
+  // Index the links from both of their nodes.
+  adjacency_offsets.assign(node_ids.size() + 1, 0);
+  for (auto &link : topology) {
+    ++adjacency_offsets[link.first_node + 1];
+    ++adjacency_offsets[link.second_node + 1];
+  }
+  for (size_t node = 0; node < node_ids.size(); ++node) {
+    adjacency_offsets[node + 1] += adjacency_offsets[node];
+  }
+  adjacency.resize(adjacency_offsets.back());
+  std::vector<int> next_entry(adjacency_offsets.begin(),
+                              adjacency_offsets.end() - 1);
+  // Links are sorted, so each node's neighbors come out sorted as well: first
+  // those below it (as second node), then those above it (as first node).
+  for (int link = 0; link < (int)topology.size(); ++link) {
+    node_t first_node = topology[link].first_node;
+    node_t second_node = topology[link].second_node;
+    adjacency[next_entry[second_node]++] = {first_node, link};
+  }
+  for (int link = 0; link < (int)topology.size(); ++link) {
+    node_t first_node = topology[link].first_node;
+    node_t second_node = topology[link].second_node;
+    adjacency[next_entry[first_node]++] = {second_node, link};
+  }
+  for (node_t node = 0; node < (node_t)node_ids.size(); ++node) {
+    for (int entry = adjacency_offsets[node];
+         entry < adjacency_offsets[node + 1]; ++entry) {
+      adjacency_index[adjacency_key(node, adjacency[entry].neighbor)] = entry;
+    }
+  }
+
+  // Queue the link changes in order of time, and of the file within each
+  // epoch, so that each epoch is appended to in one go. Files are usually in
+  // order already.
+  auto earlier = [](const link_event_t &a, const link_event_t &b) {
+    return a.time < b.time;
+  };
+  if (!std::is_sorted(link_events.begin(), link_events.end(), earlier)) {
+    std::stable_sort(link_events.begin(), link_events.end(), earlier);
+  }
+  bool replay = verify_against_sequential || selected_protocols.size() > 1;
+  if (replay) {
+    topology_events.reserve(2 * link_events.size());
+  }
+  for (auto &link : link_events) {
+    // Insert two link change events, one for each side of the link.
+    event_t event;
+    event.type = LINK_CHANGE;
+    event.link_change.node = link.first_node;
+    event.link_change.neighbor = link.second_node;
+    event.link_change.new_cost = link.cost;
+    for (int side = 0; side < 2; ++side) {
+      events.push(link.time, event);
+      if (replay) {
+        topology_events.push_back({link.time, event});
       }
+      std::swap(event.link_change.node, event.link_change.neighbor);
     }
   }
 }
 
-static void init_node_states() {
-  for (auto node : nodes) {
+void simulation_t::free_node_states() {
+  for (node_t node = 0; node < (node_t)node_states.size(); ++node) {
+    current_node = node;
+    protocol->free_state(node_states[node]);
+  }
+  node_states.clear();
+}
+
+void simulation_t::init_node_states() {
+  routes.assign(node_ids.size() * node_ids.size(), NO_ROUTE);
+  // Delta snapshots start from every link and route down, as they are now.
+  track_changes = steps_dot && steps_delta;
+  route_dirty.assign(track_changes ? routes.size() : 0, 0);
+  link_dirty.assign(track_changes ? topology.size() : 0, 0);
+  dirty_routes.assign(num_threads, {});
+  dirty_links.clear();
+  node_states.resize(node_ids.size());
+  for (node_t node = 0; node < (node_t)node_ids.size(); ++node) {
     current_node = node;
-    node_states[current_node] = init_state();
+    node_states[current_node] = protocol->init_state();
   }
 }
 
-state_t *get_state() { return node_states[current_node]; }
+void *simulation_t::get_state() const { return node_states[current_node]; }
 
-static void dump_network_snapshot(std::ostream &dot_file) {
+// Dump the network to a dot file. Delta snapshots only show the links and
+// routes that changed since the previous one, with removed routes dotted.
+void simulation_t::dump_network_snapshot(std::ostream &dot_file, bool delta) {
   // Graphviz header and timestamp.
-  dot_file << "digraph N {" << std::endl                             //
-           << "  label = \"t=" << current_time << "\";" << std::endl //
-           << "  labelloc = \"top\";" << std::endl                   //
-           << "  labeljust = \"left\";" << std::endl;
+  dot_file << "digraph N {" << '\n'                             //
+           << "  label = \"t=" << current_time << "\";" << '\n' //
+           << "  labelloc = \"top\";" << '\n'                   //
+           << "  labeljust = \"left\";" << '\n';
 
   // Dump colored nodes. Highlight recipient of next event in bold.
-  for (auto node : nodes) {
-    dot_file << "  node" << node                 //
-             << " [ label = \"" << node << "\" " //
-             << "style = \"filled"               //
+  for (node_t node = 0; node < (node_t)node_ids.size(); ++node) {
+    dot_file << "  node" << node_ids[node]                 //
+             << " [ label = \"" << node_ids[node] << "\" " //
+             << "style = \"filled"                         //
              << (((!epoch_steps) && (!events.empty()) &&
-                  ((events.begin()->second.type == LINK_CHANGE &&
-                    events.begin()->second.link_change.node == node) ||
-                   (events.begin()->second.type == MESSAGE &&
-                    events.begin()->second.message.destination == node)))
+                  ((events.front().type == LINK_CHANGE &&
+                    events.front().link_change.node == node) ||
+                   (events.front().type == MESSAGE &&
+                    events.front().message.destination == node) ||
+                   (events.front().type == TIMER &&
+                    events.front().timer.node == node)))
                      ? ",bold"
                      : "")
              << "\" " //
-             << "fillcolor = \"" << colors[node] << "\" ];" << std::endl;
+             << "fillcolor = \"" << colors[node_ids[node]] << "\" ];"
+             << '\n';
   }
 
   // Bold black lines for undirected topology.
   // Add dot for interface that is being notified of change.
-  for (auto edge : topology) {
-    if (edge.second < COST_INFINITY ||
-        ((!events.empty()) && events.begin()->second.type == LINK_CHANGE &&
-         ((events.begin()->second.link_change.node == edge.first.first &&
-           events.begin()->second.link_change.neighbor == edge.first.second) ||
-          (events.begin()->second.link_change.node == edge.first.second &&
-           events.begin()->second.link_change.neighbor == edge.first.first)))) {
-      dot_file << "  node" << edge.first.first    //
-               << " -> node" << edge.first.second //
-               << " [ dir = \"both\" "            //
-               << "label = \""
-               << (edge.second < COST_INFINITY
-                       ? std::to_string((int)edge.second)
-                       : "∞")
-               << "\" "               //
-               << "style = \"bold\" " //
-               << "arrowtail = \""
-               << ((!epoch_steps) && (!events.empty()) &&
-                           events.begin()->second.type == LINK_CHANGE &&
-                           events.begin()->second.link_change.node ==
-                               edge.first.first &&
-                           events.begin()->second.link_change.neighbor ==
-                               edge.first.second
-                       ? "dot"
-                       : "none")
-               << "\" " //
-               << "arrowhead = \""
-               << ((!epoch_steps) && (!events.empty()) &&
-                           events.begin()->second.type == LINK_CHANGE &&
-                           events.begin()->second.link_change.node ==
-                               edge.first.second &&
-                           events.begin()->second.link_change.neighbor ==
-                               edge.first.first
-                       ? "dot"
-                       : "none")
-               << "\"];" << std::endl;
-    }
-  }
-
-  // Colored arrows for directed routes.
-  for (auto node : routes) {
-    for (auto destination : node.second) {
-      if ((show_routes_for < 0 || show_routes_for == destination.first)) {
-        dot_file << "  node" << node.first                              //
-                 << " -> node" << destination.second.first              //
-                 << " [ color = \"" << colors[destination.first]        //
-                 << "\" fontcolor = \"" << colors[destination.first]    //
-                 << "\" label = \"" << ((int)destination.second.second) //
-                 << "\" ];" << std::endl;
+  auto notified = [&](const link_t &edge) {
+    return (!events.empty()) && events.front().type == LINK_CHANGE &&
+           ((events.front().link_change.node == edge.first_node &&
+             events.front().link_change.neighbor == edge.second_node) ||
+            (events.front().link_change.node == edge.second_node &&
+             events.front().link_change.neighbor == edge.first_node));
+  };
+  auto dump_link = [&](const link_t &edge) {
+    dot_file << "  node" << node_ids[edge.first_node]    //
+             << " -> node" << node_ids[edge.second_node] //
+             << " [ dir = \"both\" "                     //
+             << "label = \""
+             << (edge.cost < COST_INFINITY
+                     ? std::to_string((int)edge.cost)
+                     : "∞")
+             << "\" "               //
+             << "style = \"bold\" " //
+             << "arrowtail = \""
+             << ((!epoch_steps) && (!events.empty()) &&
+                         events.front().type == LINK_CHANGE &&
+                         events.front().link_change.node ==
+                             edge.first_node &&
+                         events.front().link_change.neighbor ==
+                             edge.second_node
+                     ? "dot"
+                     : "none")
+             << "\" " //
+             << "arrowhead = \""
+             << ((!epoch_steps) && (!events.empty()) &&
+                         events.front().type == LINK_CHANGE &&
+                         events.front().link_change.node ==
+                             edge.second_node &&
+                         events.front().link_change.neighbor ==
+                             edge.first_node
+                     ? "dot"
+                     : "none")
+             << "\"];" << '\n';
+  };
+  if (delta) {
+    // Only the links that changed, and the one being notified, in order.
+    if (!events.empty() && events.front().type == LINK_CHANGE) {
+      int link = adjacency[adjacency_index.at(adjacency_key(
+                               events.front().link_change.node,
+                               events.front().link_change.neighbor))]
+                     .link;
+      if (!link_dirty[link]) {
+        dirty_links.push_back({link, topology[link].cost});
+      }
+    }
+    std::sort(dirty_links.begin(), dirty_links.end(),
+              [](const dirty_link_t &a, const dirty_link_t &b) {
+                return a.link < b.link;
+              });
+    for (auto &dirty : dirty_links) {
+      const link_t &edge = topology[dirty.link];
+      if (edge.cost != dirty.last || notified(edge)) {
+        dump_link(edge);
+      }
+      link_dirty[dirty.link] = 0;
+    }
+    dirty_links.clear();
+  } else {
+    for (auto &edge : topology) {
+      if (edge.cost < COST_INFINITY || notified(edge)) {
+        dump_link(edge);
+      }
+    }
+  }
+
+  // Colored arrows for directed routes, dotted to the last next hop if removed.
+  auto dump_route = [&](size_t index, const route_t &last) {
+    const route_t &route = routes[index];
+    node_t node = index / node_ids.size();
+    node_t destination_id = node_ids[index % node_ids.size()];
+    if (show_routes_for < 0 || show_routes_for == destination_id) {
+      dot_file << "  node" << node_ids[node] << " -> node"
+               << node_ids[route.valid ? route.next_hop : last.next_hop]
+               << " [ color = \"" << colors[destination_id]     //
+               << "\" fontcolor = \"" << colors[destination_id] //
+               << "\" label = \""
+               << (route.valid ? std::to_string((int)route.cost) : "∞")
+               << (route.valid ? "\"" : "\" style = \"dotted\"") //
+               << " ];" << '\n';
+    }
+  };
+  if (delta) {
+    // Only the routes that changed, in order, taken off every worker.
+    for (auto &worker_routes : dirty_routes) {
+      delta_routes.insert(delta_routes.end(), worker_routes.begin(),
+                          worker_routes.end());
+      worker_routes.clear();
+    }
+    std::sort(delta_routes.begin(), delta_routes.end(),
+              [](const dirty_route_t &a, const dirty_route_t &b) {
+                return a.route < b.route;
+              });
+    for (auto &dirty : delta_routes) {
+      const route_t &route = routes[dirty.route];
+      if (route.next_hop != dirty.last.next_hop ||
+          route.cost != dirty.last.cost || route.valid != dirty.last.valid) {
+        dump_route(dirty.route, dirty.last);
+      }
+      route_dirty[dirty.route] = 0;
+    }
+    delta_routes.clear();
+  } else {
+    for (size_t route = 0; route < routes.size(); ++route) {
+      if (routes[route].valid) {
+        dump_route(route, NO_ROUTE);
       }
     }
   }
@@ -247,26 +955,54 @@ static void dump_network_snapshot(std::ostream &dot_file) {
   // Dashed arrow for messages. Black if being delivered, gray for future
   // delivery.
   if (show_messages) {
-    for (auto event = events.begin(); event != events.end(); event++) {
-      if (event->second.type == MESSAGE) {
-        if (show_future_messages || event == events.begin()) {
-          dot_file << "  node" << event->second.message.source        //
-                   << " -> node" << event->second.message.destination //
+    bool first = true;
+    events.for_each([&](const event_t &event) {
+      if (event.type == MESSAGE) {
+        if (show_future_messages || first) {
+          dot_file << "  node" << node_ids[event.message.source]        //
+                   << " -> node" << node_ids[event.message.destination] //
                    << " [ color = \""
-                   << ((!epoch_steps) && event == events.begin()
-                           ? COLOR_CURRENT_MESSAGE
-                           : COLOR_FUTURE_MESSAGE) //
-                   << "\" style = \"dashed\" ];" << std::endl;
+                   << ((!epoch_steps) && first ? COLOR_CURRENT_MESSAGE
+                                               : COLOR_FUTURE_MESSAGE) //
+                   << "\" style = \"dashed\" ];" << '\n';
         }
       }
-    }
+      first = false;
+    });
   }
 
   // Footer.
-  dot_file << "}" << std::endl << std::endl;
+  dot_file << "}" << '\n' << '\n';
 }
 
-static void process_event(event_t event) {
+payload_arena_t &simulation_t::payload_arena(int worker, event_time_t time) {
+  return payload_arenas[2 * (size_t)worker + (time & 1)];
+}
+
+size_t simulation_t::payload_bytes_used() const {
+  size_t used = 0;
+  for (auto &arena : payload_arenas) {
+    used += arena.used();
+  }
+  return used;
+}
+
+// Allocate a payload for a message sent during the current epoch.
+void *simulation_t::allocate_payload(size_t length) {
+  // Messages are delivered during the next epoch.
+  return payload_arena(current_worker, current_time + 1).allocate(length);
+}
+
+// Queue an event, or keep it for merging if running in parallel.
+void simulation_t::schedule_event(event_time_t time, const event_t &event) {
+  if (scheduled != nullptr) {
+    scheduled->push_back({scheduled_index, time, event});
+  } else {
+    events.push(time, event);
+  }
+}
+
+void simulation_t::process_event(event_t event) {
   switch (event.type) {
   case LINK_CHANGE: { // Update topology and notify node.
     set_topology_cost(event.link_change.node, event.link_change.neighbor,
@@ -274,53 +1010,173 @@ static void process_event(event_t event) {
     changed = true;
 
     current_node = event.link_change.node;
-    notify_link_change(event.link_change.neighbor, event.link_change.new_cost);
+    protocol->notify_link_change(event.link_change.neighbor,
+                                 event.link_change.new_cost);
     ++num_link_changes;
   } break;
 
-  case MESSAGE: { // Deliver message to node and free the message buffer.
+  case MESSAGE: { // Deliver message to node.
     current_node = event.message.destination;
-    notify_receive_message(event.message.source, event.message.content,
-                           event.message.length);
-    free(event.message.content);
+    protocol->notify_receive_message(event.message.source,
+                                     event.message.content,
+                                     event.message.length);
     ++num_messages;
   } break;
 
+  case TIMER: { // Wake node up.
+    current_node = event.timer.node;
+    protocol->notify_timer();
+    ++num_timers;
+  } break;
+
   default: {
     assert(false && "Unknown event type.");
   }
   }
 }
 
-static void process_events() {
+void simulation_t::dump_step() {
+  if (!steps_dot || current_time < steps_first ||
+      (steps_last >= 0 && current_time > steps_last) ||
+      num_steps++ % steps_every != 0) {
+    return;
+  }
+  dump_network_snapshot(steps_dot_file, steps_delta);
+}
+
+static node_t event_node(const event_t &event) {
+  switch (event.type) {
+  case LINK_CHANGE:
+    return event.link_change.node;
+  case MESSAGE:
+    return event.message.destination;
+  default:
+    return event.timer.node;
+  }
+}
+
+// Process the events pending for the current epoch on every worker. Link
+// changes update the shared topology, so they come first, in order, on this
+// thread. Every other event only touches the node it is for, so they run in
+// parallel grouped by node, and the events they schedule are queued in the
+// order they would have been sequentially.
+void simulation_t::process_epoch_in_parallel() {
+  batch.clear();
+  while (!events.empty() && events.front_time() == current_time) {
+    batch.push_back(events.front());
+    events.pop();
+  }
+  num_events += batch.size();
+
+  size_t first = 0;
+  for (; first < batch.size() && batch[first].type == LINK_CHANGE; ++first) {
+    process_event(batch[first]);
+  }
+
+  // Group the remaining events by node, keeping their order.
+  node_offsets.assign(node_ids.size() + 1, 0);
+  for (size_t e = first; e < batch.size(); ++e) {
+    assert(batch[e].type != LINK_CHANGE && "Link change after messages.");
+    ++node_offsets[event_node(batch[e]) + 1];
+  }
+  group_nodes.clear();
+  for (node_t node = 0; node < (node_t)node_ids.size(); ++node) {
+    if (node_offsets[node + 1] > 0) {
+      group_nodes.push_back(node);
+    }
+    node_offsets[node + 1] += node_offsets[node];
+  }
+  order.resize(batch.size() - first);
+  for (size_t e = first; e < batch.size(); ++e) {
+    order[node_offsets[event_node(batch[e])]++] = e;
+  }
+  // Offsets now point at the end of each group.
+
+  std::atomic<size_t> next_group(0);
+  workers.run([&](int worker) {
+    current_simulation = this;
+    current_worker = worker;
+    scheduled = &worker_scheduled[worker];
+    scheduled->clear();
+    for (size_t group; (group = next_group++) < group_nodes.size();) {
+      node_t node = group_nodes[group];
+      size_t end = node_offsets[node];
+      size_t begin = node == 0 ? 0 : node_offsets[node - 1];
+      for (size_t i = begin; i < end; ++i) {
+        scheduled_index = order[i];
+        process_event(batch[order[i]]);
+      }
+    }
+    scheduled = nullptr;
+  });
+
+  // Merge the scheduled events by the index of the event that scheduled them.
+  index_offsets.assign(batch.size() + 1, 0);
+  for (auto &worker_events : worker_scheduled) {
+    for (auto &event : worker_events) {
+      ++index_offsets[event.index + 1];
+    }
+  }
+  for (size_t e = 0; e < batch.size(); ++e) {
+    index_offsets[e + 1] += index_offsets[e];
+  }
+  merged.resize(index_offsets.back());
+  for (auto &worker_events : worker_scheduled) {
+    for (auto &event : worker_events) {
+      merged[index_offsets[event.index]++] = &event;
+    }
+  }
+  for (auto event : merged) {
+    events.push(event->time, event->event);
+  }
+}
+
+void simulation_t::process_events() {
   // Continue until no more events.
   while (!events.empty() && (max_events < 0 || num_events < max_events)) {
-    current_time = events.begin()->first;
+    if (events.front_time() != current_time) {
+      // All messages delivered during the previous epoch are done with.
+      if (current_time >= 0) {
+        peak_payload_bytes = std::max(peak_payload_bytes, payload_bytes_used());
+        for (int worker = 0; worker < num_threads; ++worker) {
+          payload_arena(worker, current_time).reset();
+        }
+      }
+      current_time = events.front_time();
+    }
 
-    static event_time_t last_snapshot_epoch = -1;
     if (!epoch_steps || current_time > last_snapshot_epoch) {
       last_snapshot_epoch = current_time;
 
       if (!epoch_steps || changed) {
-        dump_network_snapshot(steps_dot_file);
+        dump_step();
         changed = false;
       }
     }
 
+    if (num_threads > 1) {
+      process_epoch_in_parallel();
+      continue;
+    }
+
     // Remove event from queue and process it.
-    event_t event = events.begin()->second;
-    events.erase(events.begin());
+    event_t event = events.front();
+    events.pop();
 
     process_event(event);
     ++num_events;
   }
+  peak_payload_bytes = std::max(peak_payload_bytes, payload_bytes_used());
   if (!epoch_steps || changed) {
-    dump_network_snapshot(steps_dot_file);
+    dump_step();
   }
-  dump_network_snapshot(final_dot_file);
 }
 
 static void show_usage(std::string command) {
+  std::string names;
+  for (const protocol_t *protocol : protocols()) {
+    names += (names.empty() ? "" : ", ") + std::string(protocol->name);
+  }
   std::cerr                                                             //
       << "Usage: " << command                                           //
       << " [--epoch-steps]"                                             //
@@ -328,10 +1184,21 @@ static void show_usage(std::string command) {
       << " [--help]"                                                    //
       << " [--hide-future-messages]"                                    //
       << " [--hide-messages]"                                           //
+      << " [--log-level <level>]"                                       //
+      << " [--log-node <node>]"                                         //
       << " [--max-events <limit>]"                                      //
+      << " [--protocol <name>[,<name>...]]"                             //
+      << " [--protocol-option <name>=<value>]"                          //
       << " [--show-routes-for <node>]"                                  //
+      << " [--steps-delta]"                                             //
       << " [--steps-dot <dot-file>]"                                    //
+      << " [--steps-every <count>]"                                     //
+      << " [--steps-range <first>:<last>]"                              //
+      << " [--threads <count>]"                                         //
+      << " [--verify-against-sequential]"                               //
       << " [--] <topology-file>" << std::endl                           //
+      << "       " << command                                           //
+      << " --manifest <manifest-file> [--jobs <count>]" << std::endl    //
       << std::endl                                                      //
       << " --epoch-steps             "                                  //
       << "- Only show one step per epoch in the steps dot file."        //
@@ -350,177 +1217,768 @@ static void show_usage(std::string command) {
       << "- Declutter dot files by hiding all messages "                //
       << "(default: show)."                                             //
       << std::endl                                                      //
+      << " --jobs <count>            "                                  //
+      << "- Run up to <count> simulations of the manifest at once "     //
+      << "(default: number of cores, at most " << MAX_THREADS << ")."  //
+      << std::endl                                                      //
+      << " --log-level <level>       "                                  //
+      << "- Only log router messages up to <level>: 0 for none, 1 for " //
+      << "events, 2 for route changes, 3 for everything (default: 3)."  //
+      << std::endl                                                      //
+      << " --log-node <node>         "                                  //
+      << "- Only log router messages of <node> (default: log all)."     //
+      << std::endl                                                      //
+      << " --manifest <manifest-file> "                                 //
+      << "- Run the simulations listed in <manifest-file>, one per line " //
+      << "as <topology-file> <protocol> [options...], and print a CSV "  //
+      << "row of stats for each, with router logs off."                 //
+      << std::endl                                                      //
       << " --max-events <limit>      "                                  //
       << "- Put a limit on the number of simulation events to process " //
       << "(default: no limit)."                                         //
       << std::endl                                                      //
+      << " --protocol <name>[,<name>...] "                              //
+      << "- Simulate each protocol in turn on the topology, out of "    //
+      << names << " (default: the only one linked in)."                 //
+      << std::endl                                                      //
+      << " --protocol-option <name>=<value> "                           //
+      << "- Set an integer option of the protocols, may be repeated: "  //
+      << "spf-delay for the epochs link state holds back shortest path " //
+      << "first runs for (default: 0), spf-linear-scan to pick the "    //
+      << "closest node with a linear scan (default: 0)."                //
+      << std::endl                                                      //
       << " --show-routes-for <node>  "                                  //
       << "- Declutter dot files by only showing routes for <node> "     //
       << "(default: show all)."                                         //
       << std::endl                                                      //
+      << " --steps-delta             "                                  //
+      << "- Only show links and routes that changed since the previous " //
+      << "step in the steps dot file."                                  //
+      << std::endl                                                      //
       << " --steps-dot <dot-file>    "                                  //
       << "- Generate a dot file showing each simulation step."          //
+      << std::endl                                                      //
+      << " --steps-every <count>     "                                  //
+      << "- Only show one step out of <count> in the steps dot file "   //
+      << "(default: 1)."                                                //
+      << std::endl                                                      //
+      << " --steps-range <first>:<last> "                               //
+      << "- Only show steps from epoch <first> to <last> in the steps " //
+      << "dot file (default: all)."                                     //
+      << std::endl                                                      //
+      << " --threads <count>         "                                  //
+      << "- Process the events of each epoch for different nodes in "   //
+      << "parallel, showing only one step per epoch and limiting events " //
+      << "by whole epochs (default: 1, at most " << MAX_THREADS << ")." //
+      << std::endl                                                      //
+      << " --verify-against-sequential "                                //
+      << "- Simulate again on a single thread afterwards and check "    //
+      << "that routes and stats are the same."                          //
       << std::endl;
   exit(EXIT_FAILURE);
 }
 
-static void report_stats() {
-  std::cout << "Simulated network of " << nodes.size() << " nodes with "
-            << num_events << " events." << std::endl
-            << "Processed " << num_link_changes << " link change events."
-            << std::endl
-            << "Processed " << num_messages << " messages." << std::endl
-            << "Simulation converged after " << current_time << " time epochs."
-            << std::endl;
+// Stats that do not depend on timing, to compare runs.
+std::vector<std::pair<std::string, long>>
+simulation_t::deterministic_stats() const {
+  return {{"events", num_events},
+          {"link change events", num_link_changes},
+          {"messages", num_messages},
+          {"timer events", num_timers},
+          {"time epochs", current_time},
+          {"peak message payload bytes", (long)peak_payload_bytes}};
 }
 
-int main(int argc, char *argv[]) {
-  // Parse command-line arguments.
-  std::string topology_file_name;
-  std::string steps_dot_file_name = "/dev/null";
-  std::string final_dot_file_name = "/dev/null";
+// Start over from the topology file events, with every link down and the node
+// states freed, for init_node_states() to set the nodes up again.
+void simulation_t::reset_simulation() {
+  free_node_states();
+  for (auto &link : topology) {
+    link.cost = COST_INFINITY;
+  }
+  events = event_queue_t();
+  for (auto &arena : payload_arenas) {
+    arena.reset();
+  }
+  num_events = 0;
+  num_link_changes = 0;
+  num_messages = 0;
+  num_timers = 0;
+  peak_payload_bytes = 0;
+  current_time = -1;
+  num_steps = 0;
+  last_snapshot_epoch = -1;
+  changed = false;
+  schedule_topology_events();
+}
+
+// Simulate again from the start on a single thread, without logging nor dot
+// files, and check that the routes and stats are the same.
+bool simulation_t::verify_sequential_run() {
+  std::vector<route_t> checked_routes = routes;
+  auto checked_stats = deterministic_stats();
+
+  // A parallel run only stops at the end of an epoch, so a limited run is
+  // checked against as many events sequentially.
+  long event_limit = max_events;
+  if (max_events >= 0) {
+    max_events = num_events;
+  }
+  reset_simulation();
+  int parallel_threads = num_threads, shown_log_level = log_level;
+  bool shown_steps = steps_dot;
+  num_threads = 1;
+  steps_dot = false;
+  log_level = 0;
+  init_node_states();
+  process_events();
+  num_threads = parallel_threads;
+  log_level = shown_log_level;
+  steps_dot = shown_steps;
+  max_events = event_limit;
+
+  bool same = true;
+  auto stats = deterministic_stats();
+  for (size_t stat = 0; stat < stats.size(); ++stat) {
+    if (stats[stat].second != checked_stats[stat].second) {
+      err << "Number of " << stats[stat].first << " differs: "
+          << checked_stats[stat].second << ", but " << stats[stat].second
+          << " sequentially." << std::endl;
+      same = false;
+    }
+  }
+  for (size_t route = 0; route < routes.size(); ++route) {
+    const route_t &a = checked_routes[route], &b = routes[route];
+    if (a.valid != b.valid || (a.valid && (a.next_hop != b.next_hop ||
+                                           a.cost != b.cost))) {
+      err << "Route from " << node_ids[route / node_ids.size()] << " to "
+          << node_ids[route % node_ids.size()] << " differs: "
+          << (a.valid ? "via " + std::to_string(node_ids[a.next_hop]) +
+                            " cost " + std::to_string((int)a.cost)
+                      : "none")
+          << ", but "
+          << (b.valid ? "via " + std::to_string(node_ids[b.next_hop]) +
+                            " cost " + std::to_string((int)b.cost)
+                      : "none")
+          << " sequentially." << std::endl;
+      same = false;
+    }
+  }
+  if (same) {
+    out << "Same routes and stats as a sequential run." << std::endl;
+  }
+  return same;
+}
+
+void simulation_t::report_stats() {
+  reports.push_back({protocol->name, node_ids.size(), num_events,
+                     num_link_changes, num_messages, num_timers, current_time,
+                     peak_payload_bytes, simulation_seconds});
+  out << "Simulated network of " << node_ids.size() << " nodes with "
+      << num_events << " events." << std::endl
+      << "Processed " << num_link_changes << " link change events."
+      << std::endl
+      << "Processed " << num_messages << " messages." << std::endl
+      << "Processed " << num_timers << " timer events." << std::endl
+      << "Simulation converged after " << current_time << " time epochs."
+      << std::endl
+      << "Peak message payload memory: " << peak_payload_bytes << " bytes."
+      << std::endl
+      << "Processed " << (long)(num_events / simulation_seconds)
+      << " events per second." << std::endl;
+}
+
+bool simulation_t::parse_arguments(const std::vector<std::string> &args) {
   bool positional_mode = false;
 
-  for (int a = 1; a < argc; ++a) {
-    std::string arg = argv[a];
+  for (size_t a = 0; a < args.size(); ++a) {
+    const std::string &arg = args[a];
     if (arg == "--epoch-steps") {
       epoch_steps = true;
     } else if (arg == "--final-dot") {
-      if (argc <= a + 1) {
-        show_usage(argv[0]);
+      if (args.size() <= a + 1) {
+        return false;
       }
-      final_dot_file_name = argv[++a];
+      final_dot_file_name = args[++a];
     } else if (arg == "--help") {
-      show_usage(argv[0]);
+      return false;
     } else if (arg == "--hide-future-messages") {
       show_future_messages = false;
     } else if (arg == "--hide-messages") {
       show_messages = false;
+    } else if (arg == "--log-level") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      try {
+        log_level = std::stoi(args[++a]);
+      } catch (...) {
+        return false;
+      }
+    } else if (arg == "--log-node") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      try {
+        log_node = std::stoi(args[++a]);
+      } catch (...) {
+        return false;
+      }
     } else if (arg == "--max-events") {
-      if (argc <= a + 1) {
-        show_usage(argv[0]);
+      if (args.size() <= a + 1) {
+        return false;
       }
       try {
-        max_events = std::stoi(argv[++a]);
+        max_events = std::stoi(args[++a]);
       } catch (...) {
-        show_usage(argv[0]);
+        return false;
+      }
+    } else if (arg == "--protocol") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      std::istringstream names(args[++a]);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        auto found = std::find_if(
+            protocols().begin(), protocols().end(),
+            [&](const protocol_t *protocol) { return name == protocol->name; });
+        if (found == protocols().end()) {
+          std::cerr << "Unknown protocol: " << name << std::endl;
+          return false;
+        }
+        selected_protocols.push_back(*found);
+      }
+    } else if (arg == "--protocol-option") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      std::string option = args[++a];
+      size_t equals = option.find('=');
+      if (equals == std::string::npos) {
+        return false;
+      }
+      try {
+        protocol_options[option.substr(0, equals)] =
+            std::stoi(option.substr(equals + 1));
+      } catch (...) {
+        return false;
       }
     } else if (arg == "--show-routes-for") {
-      if (argc <= a + 1) {
-        show_usage(argv[0]);
+      if (args.size() <= a + 1) {
+        return false;
       }
       try {
-        show_routes_for = std::stoi(argv[++a]);
+        show_routes_for = std::stoi(args[++a]);
       } catch (...) {
-        show_usage(argv[0]);
+        return false;
       }
+    } else if (arg == "--steps-delta") {
+      steps_delta = true;
     } else if (arg == "--steps-dot") {
-      if (argc <= a + 1) {
-        show_usage(argv[0]);
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      steps_dot_file_name = args[++a];
+      steps_dot = true;
+    } else if (arg == "--steps-every") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      try {
+        steps_every = std::stol(args[++a]);
+      } catch (...) {
+        return false;
+      }
+      if (steps_every < 1) {
+        return false;
+      }
+    } else if (arg == "--steps-range") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      std::string range = args[++a];
+      size_t colon = range.find(':');
+      if (colon == std::string::npos) {
+        return false;
+      }
+      try {
+        steps_first = std::stoi(range.substr(0, colon));
+        steps_last = std::stoi(range.substr(colon + 1));
+      } catch (...) {
+        return false;
       }
-      steps_dot_file_name = argv[++a];
+    } else if (arg == "--threads") {
+      if (args.size() <= a + 1) {
+        return false;
+      }
+      try {
+        num_threads = std::stoi(args[++a]);
+      } catch (...) {
+        return false;
+      }
+      if (num_threads < 1 || num_threads > MAX_THREADS) {
+        return false;
+      }
+    } else if (arg == "--verify-against-sequential") {
+      verify_against_sequential = true;
     } else if (arg == "--") {
       positional_mode = true;
     } else {
       if ((arg.rfind("-", 0) == 0 && !positional_mode) ||
           !topology_file_name.empty()) {
         std::cerr << "Unknown option: " << arg << std::endl;
-        show_usage(argv[0]);
+        return false;
       }
       topology_file_name = arg;
     }
   }
 
   if (topology_file_name.empty()) {
-    show_usage(argv[0]);
+    return false;
   }
-  topology_file.open(topology_file_name);
-  if (!topology_file.is_open()) {
-    std::cerr << "Error opening topology file: " << topology_file_name
-              << std::endl;
-    exit(EXIT_FAILURE);
+  if (selected_protocols.empty()) {
+    if (protocols().size() != 1) {
+      std::cerr << "No protocol given." << std::endl;
+      return false;
+    }
+    selected_protocols = protocols();
+  }
+  return true;
+}
+
+int simulation_t::run() {
+  current_simulation = this;
+  topology_fd = open(topology_file_name.c_str(), O_RDONLY);
+  if (topology_fd < 0) {
+    throw simulation_error_t("Error opening topology file: " +
+                             topology_file_name);
   }
 
   steps_dot_file.open(steps_dot_file_name);
   if (!steps_dot_file.is_open()) {
-    std::cerr << "Error opening output file: " << steps_dot_file_name
-              << std::endl;
-    exit(EXIT_FAILURE);
+    throw simulation_error_t("Error opening output file: " +
+                             steps_dot_file_name);
   }
 
   final_dot_file.open(final_dot_file_name);
   if (!final_dot_file.is_open()) {
-    std::cerr << "Error opening output file: " << final_dot_file_name
-              << std::endl;
-    exit(EXIT_FAILURE);
+    throw simulation_error_t("Error opening output file: " +
+                             final_dot_file_name);
+  }
+
+  payload_arenas = std::vector<payload_arena_t>(2 * (size_t)num_threads);
+  if (num_threads > 1) {
+    // Events within an epoch are not processed one by one.
+    epoch_steps = true;
+    worker_scheduled.resize(num_threads);
+    workers.start(num_threads);
   }
 
-  // Load network topology and create the initial set of link change events.
+  // Load network topology and create the initial set of link change events,
+  // once for all protocols.
   load_topology_events();
-  // Initialize each node's state.
-  init_node_states();
-  // Process events until none are left.
-  process_events();
-  // Show final report.
-  report_stats();
-  return 0;
+  int status = 0;
+  for (size_t p = 0; p < selected_protocols.size(); ++p) {
+    if (p > 0) {
+      reset_simulation();
+    }
+    protocol = selected_protocols[p];
+    if (selected_protocols.size() > 1) {
+      out << "Simulating protocol " << protocol->name << "." << std::endl;
+    }
+    // Initialize each node's state.
+    init_node_states();
+    // Process events until none are left.
+    auto start = std::chrono::steady_clock::now();
+    process_events();
+    simulation_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    dump_network_snapshot(final_dot_file);
+    // Show final report.
+    report_stats();
+    if (verify_against_sequential && !verify_sequential_run()) {
+      status = EXIT_FAILURE;
+    }
+  }
+  free_node_states();
+  return status;
+}
+
+// Simulation of a manifest line, and its outcome once finished.
+struct job_t {
+  long line_number;
+  std::string topology, protocol, flags;
+  std::ostringstream output, errors;
+  std::unique_ptr<simulation_t> simulation;
+  std::vector<report_t> reports;
+  double wall_seconds = 0;
+  int status = 0;
+  bool finished = false;
+};
+
+// Quote a CSV field, doubling the quotes within it.
+static std::string csv_quote(const std::string &field) {
+  std::string quoted = "\"";
+  for (char c : field) {
+    quoted += c;
+    if (c == '"') {
+      quoted += '"';
+    }
+  }
+  return quoted + '"';
+}
+
+// Simulate the manifest lines, each a topology file, a protocol and any flags
+// for it separated by blanks, on num_jobs threads, and print a CSV row of stats
+// for each, in manifest order. Blank lines and lines starting with # are
+// skipped.
+static int run_manifest(const std::string &manifest_file_name, int num_jobs,
+                        const std::string &command) {
+  std::ifstream manifest(manifest_file_name);
+  if (!manifest.is_open()) {
+    std::cerr << "Error opening manifest file: " << manifest_file_name
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Check every line before simulating any.
+  std::vector<std::unique_ptr<job_t>> jobs;
+  std::string line;
+  for (long line_number = 1; std::getline(manifest, line); ++line_number) {
+    std::istringstream words(line);
+    std::vector<std::string> fields{std::istream_iterator<std::string>(words),
+                                    std::istream_iterator<std::string>()};
+    if (fields.empty() || fields[0][0] == '#') {
+      continue;
+    }
+
+    std::unique_ptr<job_t> job(new job_t());
+    job->line_number = line_number;
+    job->simulation.reset(new simulation_t(job->output, job->errors));
+    bool valid = fields.size() >= 2 && fields[1].find(',') == std::string::npos;
+    if (valid) {
+      job->topology = fields[0];
+      job->protocol = fields[1];
+      std::vector<std::string> args = {"--protocol", job->protocol};
+      for (size_t f = 2; f < fields.size(); ++f) {
+        valid = valid && fields[f] != "--protocol";
+        job->flags += (f > 2 ? " " : "") + fields[f];
+        args.push_back(fields[f]);
+      }
+      // Router logs of simulations running at once would only interleave.
+      args.insert(args.end(), {"--log-level", "0", "--", job->topology});
+      valid = valid && job->simulation->parse_arguments(args);
+    }
+    if (!valid) {
+      std::cerr << "Invalid simulation in manifest file on line "
+                << line_number << "." << std::endl;
+      show_usage(command);
+    }
+    jobs.push_back(std::move(job));
+  }
+
+  // Each thread takes on the next simulation left, and frees it once done.
+  std::atomic<size_t> next_job(0);
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < num_jobs && (size_t)thread < jobs.size();
+       ++thread) {
+    threads.emplace_back([&] {
+      for (size_t j; (j = next_job++) < jobs.size();) {
+        job_t &job = *jobs[j];
+        auto start = std::chrono::steady_clock::now();
+        try {
+          job.status = job.simulation->run();
+        } catch (const simulation_error_t &error) {
+          job.errors << error.what() << std::endl;
+          job.status = EXIT_FAILURE;
+        }
+        job.reports = job.simulation->get_reports();
+        job.simulation.reset();
+        job.wall_seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          job.finished = true;
+        }
+        finished.notify_all();
+      }
+    });
+  }
+
+  // Print the rows as soon as all simulations before them are done.
+  std::cout << "topology,protocol,flags,nodes,events,link_changes,messages,"
+            << "timers,epochs,peak_payload_bytes,events_per_second,"
+            << "wall_seconds,exit_status" << std::endl;
+  int status = 0;
+  for (auto &job : jobs) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&] { return job->finished; });
+    }
+    std::cout << csv_quote(job->topology) << ',' << csv_quote(job->protocol)
+              << ',' << csv_quote(job->flags) << ',';
+    if (job->reports.empty()) { // Failed before reporting any stats.
+      std::cout << ",,,,,,,";
+    } else {
+      const report_t &report = job->reports.front();
+      std::cout << report.nodes << ',' << report.events << ','
+                << report.link_changes << ',' << report.messages << ','
+                << report.timers << ',' << report.epochs << ','
+                << report.peak_payload_bytes << ','
+                << (long)(report.events / report.seconds);
+    }
+    std::cout << ',' << std::fixed << std::setprecision(3) << job->wall_seconds
+              << ',' << job->status << std::endl;
+
+    std::istringstream errors(job->errors.str());
+    for (std::string error; std::getline(errors, error);) {
+      std::cerr << manifest_file_name << ":" << job->line_number << ": "
+                << error << std::endl;
+    }
+    if (job->status != 0) {
+      status = EXIT_FAILURE;
+    }
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  if (!args.empty() && args[0] == "--manifest") {
+    int num_jobs = std::min(
+        std::max(1, (int)std::thread::hardware_concurrency()), MAX_THREADS);
+    if (args.size() == 4 && args[2] == "--jobs") {
+      try {
+        num_jobs = std::stoi(args[3]);
+      } catch (...) {
+        show_usage(argv[0]);
+      }
+    } else if (args.size() != 2) {
+      show_usage(argv[0]);
+    }
+    if (num_jobs < 1 || num_jobs > MAX_THREADS) {
+      show_usage(argv[0]);
+    }
+    return run_manifest(args[1], num_jobs, argv[0]);
+  }
+
+  simulation_t simulation(std::cout, std::cerr);
+  if (!simulation.parse_arguments(args)) {
+    show_usage(argv[0]);
+  }
+  try {
+    return simulation.run();
+  } catch (const simulation_error_t &error) {
+    std::cerr << error.what() << std::endl;
+    return EXIT_FAILURE;
+  }
 }
 
 /******************************************************************************\
 * Router API: Functions called by the router module.                           *
 \******************************************************************************/
 
+int register_protocol(const protocol_t *protocol) {
+  protocols().push_back(protocol);
+  return protocols().size();
+}
+
 node_t get_current_node() { return current_node; }
 
-event_time_t get_current_time() { return current_time; }
+event_time_t get_current_time() {
+  return current_simulation->get_current_time();
+}
+
+int simulation_t::log_enabled(int level) const {
+  return level <= log_level &&
+         (log_node < 0 || node_ids[current_node] == log_node);
+}
+
+int log_enabled(int level) { return current_simulation->log_enabled(level); }
 
-node_t get_first_node() { return *nodes.begin(); }
+void *get_state() { return current_simulation->get_state(); }
+
+int simulation_t::get_protocol_option(const char *name,
+                                      int default_value) const {
+  auto found = protocol_options.find(name);
+  return found == protocol_options.end() ? default_value : found->second;
+}
+
+int get_protocol_option(const char *name, int default_value) {
+  return current_simulation->get_protocol_option(name, default_value);
+}
+
+node_t get_first_node() { return 0; }
 
 node_t get_next_node(node_t node) { return node + 1; }
 
-node_t get_last_node() { return *nodes.rbegin(); }
+node_t get_last_node() { return current_simulation->get_num_nodes() - 1; }
 
-cost_t get_link_cost(node_t neighbor) {
+int get_num_nodes() { return current_simulation->get_num_nodes(); }
+
+node_t simulation_t::get_first_neighbor() const {
+  return get_first_neighbor_link().neighbor;
+}
+
+node_t get_first_neighbor() { return current_simulation->get_first_neighbor(); }
+
+node_t simulation_t::get_next_neighbor(node_t neighbor) const {
+  auto entry = adjacency_index.find(adjacency_key(current_node, neighbor));
+  assert(entry != adjacency_index.end() && "Not a neighbor.");
+  return find_neighbor_link(current_node, entry->second + 1).neighbor;
+}
+
+node_t get_next_neighbor(node_t neighbor) {
+  return current_simulation->get_next_neighbor(neighbor);
+}
+
+neighbor_link_t simulation_t::get_first_neighbor_link() const {
+  return find_neighbor_link(current_node, adjacency_offsets[current_node]);
+}
+
+neighbor_link_t get_first_neighbor_link() {
+  return current_simulation->get_first_neighbor_link();
+}
+
+neighbor_link_t
+simulation_t::get_next_neighbor_link(neighbor_link_t link) const {
+  assert(link.entry >= adjacency_offsets[current_node] &&
+         link.entry < adjacency_offsets[current_node + 1] &&
+         adjacency[link.entry].neighbor == link.neighbor &&
+         "Not a link of the current node.");
+  return find_neighbor_link(current_node, link.entry + 1);
+}
+
+neighbor_link_t get_next_neighbor_link(neighbor_link_t link) {
+  return current_simulation->get_next_neighbor_link(link);
+}
+
+cost_t simulation_t::get_link_cost(node_t neighbor) const {
   return get_topology_cost(current_node, neighbor);
 }
 
-void set_route(node_t destination, node_t next_hop, cost_t cost) {
-  assert(nodes.count(current_node) && "Current node unknown.");
-  assert((nodes.count(destination) || cost == COST_INFINITY) &&
+cost_t get_link_cost(node_t neighbor) {
+  return current_simulation->get_link_cost(neighbor);
+}
+
+void simulation_t::set_route(node_t destination, node_t next_hop, cost_t cost) {
+  assert(is_node(current_node) && "Current node unknown.");
+  assert((is_node(destination) || cost == COST_INFINITY) &&
          "Route destination unknown.");
-  assert((nodes.count(next_hop) || cost == COST_INFINITY) &&
+  assert((is_node(next_hop) || cost == COST_INFINITY) &&
          "Route next hop unknown.");
   assert((get_link_cost(next_hop) < COST_INFINITY || cost == COST_INFINITY) &&
          "Route next hop not a neighbor.");
 
+  if (!is_node(destination)) { // No route to remove.
+    return;
+  }
+
+  route_t route = NO_ROUTE;
   if (cost < COST_INFINITY) {
-    if ((!routes[current_node].count(destination)) ||
-        routes[current_node][destination] != std::make_pair(next_hop, cost)) {
-      changed = true;
-    }
+    route.next_hop = next_hop;
+    route.cost = cost;
+    route.valid = true;
+  }
 
-    routes[current_node][destination] = std::make_pair(next_hop, cost);
-  } else {
-    if (routes[current_node].count(destination)) {
-      changed = true;
+  size_t index = current_node * node_ids.size() + destination;
+  route_t &entry = routes[index];
+  if (entry.next_hop != route.next_hop || entry.cost != route.cost ||
+      entry.valid != route.valid) {
+    changed = true;
+    if (track_changes && !route_dirty[index]) {
+      route_dirty[index] = 1;
+      dirty_routes[current_worker].push_back({index, entry});
     }
-
-    routes[current_node].erase(destination);
+    entry = route;
   }
 }
 
-void send_message(node_t neighbor, void *message, size_t length) {
+void set_route(node_t destination, node_t next_hop, cost_t cost) {
+  current_simulation->set_route(destination, next_hop, cost);
+}
+
+void *simulation_t::reserve_message(node_t neighbor, size_t length) {
+  assert(reserved_content == nullptr && "Previous message not committed.");
   assert(neighbor != current_node && "Sending message to self.");
   assert(get_link_cost(neighbor) < COST_INFINITY &&
          "Message destination not a neighbor.");
 
-  // Send message during the next epoch.
+  reserved_content = allocate_payload(length);
+  reserved_length = length;
+  reserved_neighbor = neighbor;
+  return reserved_content;
+}
+
+void *reserve_message(node_t neighbor, size_t length) {
+  return current_simulation->reserve_message(neighbor, length);
+}
+
+void *reserve_broadcast(size_t length) {
+  return reserve_broadcast_except(-1, length);
+}
+
+void *simulation_t::reserve_broadcast_except(node_t neighbor, size_t length) {
+  assert(reserved_content == nullptr && "Previous message not committed.");
+
+  reserved_content = allocate_payload(length);
+  reserved_length = length;
+  reserved_neighbor = -1;
+  reserved_except = neighbor;
+  return reserved_content;
+}
+
+void *reserve_broadcast_except(node_t neighbor, size_t length) {
+  return current_simulation->reserve_broadcast_except(neighbor, length);
+}
+
+void simulation_t::commit_message() {
+  assert(reserved_content != nullptr && "No message reserved.");
+
   event_t event;
   event.type = MESSAGE;
   event.message.source = current_node;
-  event.message.destination = neighbor;
-  event.message.content = malloc(length);
-  memcpy(event.message.content, message, length);
-  event.message.length = length;
-  events.insert(std::make_pair(current_time + 1, event));
+  event.message.content = reserved_content;
+  event.message.length = reserved_length;
+  if (reserved_neighbor >= 0) {
+    event.message.destination = reserved_neighbor;
+    schedule_event(current_time + 1, event);
+  } else { // Every neighbor shares the same payload.
+    for (neighbor_link_t link = get_first_neighbor_link(); link.neighbor >= 0;
+         link = get_next_neighbor_link(link)) {
+      if (link.neighbor == reserved_except) {
+        continue;
+      }
+      event.message.destination = link.neighbor;
+      schedule_event(current_time + 1, event);
+    }
+  }
+  reserved_content = nullptr;
 }
+
+void commit_message() { current_simulation->commit_message(); }
+
+void send_message(node_t neighbor, void *message, size_t length) {
+  memcpy(reserve_message(neighbor, length), message, length);
+  commit_message();
+}
+
+void simulation_t::set_timer(event_time_t delay) {
+  assert(delay >= 0 && "Setting timer in the past.");
+
+  event_t event;
+  event.type = TIMER;
+  event.timer.node = current_node;
+  // Queued after every event already pending for its epoch.
+  schedule_event(current_time + delay, event);
+}
+
+void set_timer(event_time_t delay) { current_simulation->set_timer(delay); }
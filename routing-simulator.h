@@ -1,8 +1,8 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef int node_t;
-#define MAX_NODES 100
 typedef int event_time_t;
 typedef uint8_t cost_t;
 #define COST_INFINITY 255
@@ -10,25 +10,64 @@ typedef uint8_t cost_t;
 #define COST_ADD(a, b)                                                         \
   (((int)(a)) + ((int)(b)) < COST_INFINITY ? (a) + (b) : COST_INFINITY)
 
-struct state_t;
-typedef struct state_t state_t;
+// Protocol logging levels, from events down to the innermost loops.
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+#define LOG_TRACE 3
+
+// Log a printf formatted message at a level. Compiles to nothing when NDEBUG
+// is defined, as in release builds, so arguments must not have side effects.
+#ifdef NDEBUG
+#define LOG(level, ...) ((void)0)
+#else
+#define LOG(level, ...)                                                        \
+  (log_enabled(level) ? (void)printf(__VA_ARGS__) : (void)0)
+#endif
 
-extern "C" {
 /******************************************************************************\
 * Router API                                                                   *
-* Router module must include implementations for the handler functions         *
-* and may use the command functions as needed.                                 *
+* Router module must include implementations for the handler functions,        *
+* register them with REGISTER_PROTOCOL(), and may use the command functions    *
+* as needed. Several modules can be linked into one simulator, so their        *
+* handlers and helpers must be static, and their state types must not share a  *
+* tag.                                                                         *
 \******************************************************************************/
 
-// Handler for the node to allocate and initialize its state.
-state_t *init_state();
-
 // Handlers to implement in router module.
-// Notify a node that a neighboring link has changed cost.
-void notify_link_change(node_t neighbor, cost_t new_cost);
+typedef struct protocol_t {
+  // Name to select the protocol with, on the command line.
+  const char *name;
+
+  // Handler for the node to allocate and initialize its state.
+  void *(*init_state)();
+
+  // Handler for the node to free its state, as returned by init_state().
+  void (*free_state)(void *state);
+
+  // Notify a node that a neighboring link has changed cost.
+  void (*notify_link_change)(node_t neighbor, cost_t new_cost);
 
-// Receive a message sent by a neighboring node.
-void notify_receive_message(node_t sender, void *message, size_t length);
+  // Receive a message sent by a neighboring node.
+  void (*notify_receive_message)(node_t sender, void *message, size_t length);
+
+  // Notify a node that a timer it set has expired.
+  void (*notify_timer)();
+} protocol_t;
+
+// Register the handlers init_state(), free_state(), notify_link_change(),
+// notify_receive_message() and notify_timer() of a router module under a name.
+#define REGISTER_PROTOCOL(name)                                                \
+  static const protocol_t protocol = {name,                                    \
+                                      init_state,                              \
+                                      free_state,                              \
+                                      notify_link_change,                      \
+                                      notify_receive_message,                  \
+                                      notify_timer};                           \
+  static int protocol_registered = register_protocol(&protocol);
+
+extern "C" {
+// Add a protocol to those the simulator can run, see REGISTER_PROTOCOL().
+int register_protocol(const protocol_t *protocol);
 
 // Commands to use.
 // Get the current node ID.
@@ -37,14 +76,43 @@ node_t get_current_node();
 // Get the current time (for debug printing).
 event_time_t get_current_time();
 
-// Access the current node's state.
-state_t *get_state();
+// Whether the current node logs messages at a level, see LOG().
+int log_enabled(int level);
+
+// Access the current node's state, as returned by its init_state().
+void *get_state();
+
+// Get the value of a protocol option given with --protocol-option, or
+// default_value when it is not given.
+int get_protocol_option(const char *name, int default_value);
 
 // Functions to help with iterating over nodes.
+// Nodes are numbered densely from 0, in the order of their topology file IDs.
 node_t get_first_node();
 node_t get_next_node(node_t node);
 node_t get_last_node();
 
+// Get the number of node IDs, for sizing arrays indexed by node.
+int get_num_nodes();
+
+// Functions to help with iterating over neighboring nodes, those with a link
+// cost below COST_INFINITY. Returns -1 when there are no more neighbors.
+node_t get_first_neighbor();
+node_t get_next_neighbor(node_t neighbor);
+
+// Link to a neighboring node, as iterated over with get_first_neighbor_link().
+typedef struct neighbor_link_t {
+  node_t neighbor; // The neighbor, or -1 when there are no more neighbors.
+  cost_t cost;     // Current cost of the link.
+  int entry;       // Position of the link in the simulator's topology.
+} neighbor_link_t;
+
+// Like get_first_neighbor() and get_next_neighbor(), but also give the cost of
+// each link, and step to the next neighbor without looking up the current one.
+// For inner loops, in place of get_next_neighbor() and get_link_cost().
+neighbor_link_t get_first_neighbor_link();
+neighbor_link_t get_next_neighbor_link(neighbor_link_t link);
+
 // Get the cost of a neighboring link. returns COST_INFINITY if not a neighbor.
 cost_t get_link_cost(node_t neighbor);
 
@@ -53,4 +121,25 @@ void set_route(node_t destination, node_t next_hop, cost_t cost);
 
 // Send a message to a neighboring node.
 void send_message(node_t neighbor, void *message, size_t length);
+
+// Reserve a buffer for a message to a neighboring node, to be filled in place
+// and then sent with commit_message().
+void *reserve_message(node_t neighbor, size_t length);
+
+// Reserve a buffer for a message to all neighboring nodes, to be filled in
+// place and then sent with commit_message(). Every neighbor receives the same
+// buffer, so receivers must not modify messages.
+void *reserve_broadcast(size_t length);
+
+// Like reserve_broadcast(), but the message is not sent to the given neighbor.
+// A neighbor of -1 sends to all neighbors.
+void *reserve_broadcast_except(node_t neighbor, size_t length);
+
+// Send the message reserved last.
+void commit_message();
+
+// Call notify_timer() on the current node after delay epochs. A delay of 0
+// expires at the end of the current epoch, once the events already pending for
+// it have been processed.
+void set_timer(event_time_t delay);
 }
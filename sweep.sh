@@ -0,0 +1,11 @@
+#!/bin/bash
+
+set -euo pipefail
+
+# Usage: sweep.sh <manifest> [jobs]
+# Run the simulations listed in the manifest, one per line as
+#   <topology-file> <protocol> [simulator flags...]
+# on as many threads at once as jobs (default: number of cores), and print one
+# CSV row of stats per simulation, in manifest order. The simulator is taken
+# from SIMULATOR_DIR (default: current directory), for instance build/release.
+exec "${SIMULATOR_DIR:-.}/routing-simulator" --manifest "${1}" --jobs "${2:-"$(nproc)"}"